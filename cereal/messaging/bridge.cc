@@ -1,9 +1,15 @@
 #include <algorithm>
 #include <cassert>
 #include <csignal>
+#include <cstring>
 #include <iostream>
 #include <map>
+#include <set>
 #include <string>
+#include <vector>
+
+#include <time.h>
+#include <zlib.h>
 
 typedef void (*sighandler_t)(int sig);
 
@@ -11,17 +17,60 @@ typedef void (*sighandler_t)(int sig);
 #include "impl_zmq.h"
 #include "services.h"
 
+// usage: bridge                               msgq -> zmq, one port per service
+//        bridge <ip> <whitelist>              zmq -> msgq, one port per service
+//        bridge --batch [whitelist]           msgq -> zmq, all services batched on BATCH_PORT
+//        bridge --batch <ip> <whitelist>      zmq -> msgq, unpacks batches into the per-service queues
+//
+// Batch options: --compress to deflate the batches, --batch-ms <ms> for the coalescing window.
+// The whitelist is a comma separated list of service names. An empty one bridges nothing from zmq
+// to msgq without --batch, and every service otherwise.
+
+#define BATCH_PORT "8100"
+#define BATCH_MAGIC 0x31425242 // "BRB1"
+#define BATCH_FLAG_COMPRESSED 1
+#define DEFAULT_BATCH_MS 5
+#define MAX_BATCH_SIZE (4 * 1024 * 1024) // Of the entries in a batch, before compression
+
+// A batch is a header followed by (optionally deflated) entries of
+// [uint8 name length][name][uint32 size][data]
+struct BatchHeader {
+  uint32_t magic;
+  uint32_t flags;
+  uint32_t count;
+  uint32_t raw_size;
+};
+
 void sigpipe_handler(int sig) {
   assert(sig == SIGPIPE);
   std::cout << "SIGPIPE received" << std::endl;
 }
 
-static std::vector<std::string> get_services(std::string whitelist_str, bool zmq_to_msgq) {
+static uint64_t nanos_monotonic() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static std::set<std::string> parse_whitelist(const std::string &whitelist_str) {
+  std::set<std::string> whitelist;
+  size_t pos = 0;
+  while (pos < whitelist_str.size()) {
+    size_t end = whitelist_str.find(',', pos);
+    if (end == std::string::npos) end = whitelist_str.size();
+    if (end > pos) whitelist.insert(whitelist_str.substr(pos, end - pos));
+    pos = end + 1;
+  }
+  return whitelist;
+}
+
+// With whitelist_only an empty whitelist allows no service, otherwise it allows every service
+static std::vector<std::string> get_services(const std::set<std::string> &whitelist, bool whitelist_only) {
   std::vector<std::string> service_list;
   for (const auto& it : services) {
     std::string name = it.name;
-    bool in_whitelist = whitelist_str.find(name) != std::string::npos;
-    if (name == "plusFrame" || name == "uiLayoutState" || (zmq_to_msgq && !in_whitelist)) {
+    bool in_whitelist = whitelist.count(name) > 0 || (!whitelist_only && whitelist.empty());
+    if (name == "plusFrame" || name == "uiLayoutState" || !in_whitelist) {
       continue;
     }
     service_list.push_back(name);
@@ -29,13 +78,7 @@ static std::vector<std::string> get_services(std::string whitelist_str, bool zmq
   return service_list;
 }
 
-int main(int argc, char** argv) {
-  signal(SIGPIPE, (sighandler_t)sigpipe_handler);
-
-  bool zmq_to_msgq = argc > 2;
-  std::string ip = zmq_to_msgq ? argv[1] : "127.0.0.1";
-  std::string whitelist_str = zmq_to_msgq ? std::string(argv[2]) : "";
-
+static void bridge_services(const std::string &ip, const std::set<std::string> &whitelist, bool zmq_to_msgq) {
   Poller *poller;
   Context *pub_context;
   Context *sub_context;
@@ -50,7 +93,7 @@ int main(int argc, char** argv) {
   }
 
   std::map<SubSocket*, PubSocket*> sub2pub;
-  for (auto endpoint: get_services(whitelist_str, zmq_to_msgq)) {
+  for (auto endpoint: get_services(whitelist, zmq_to_msgq)) {
     PubSocket * pub_sock;
     SubSocket * sub_sock;
     if (zmq_to_msgq) {
@@ -75,5 +118,197 @@ int main(int argc, char** argv) {
       delete msg;
     }
   }
+}
+
+static void send_batch(PubSocket *pub_sock, const std::string &entries, uint32_t count, bool compress, std::string &buf) {
+  BatchHeader header = {.magic = BATCH_MAGIC, .flags = 0, .count = count, .raw_size = (uint32_t)entries.size()};
+
+  size_t payload_size = entries.size();
+  buf.resize(sizeof(header) + (compress ? compressBound(entries.size()) : entries.size()));
+  if (compress) {
+    uLongf dest_len = buf.size() - sizeof(header);
+    int ret = compress2((Bytef *)&buf[sizeof(header)], &dest_len, (const Bytef *)entries.data(), entries.size(), Z_BEST_SPEED);
+    assert(ret == Z_OK);
+    header.flags |= BATCH_FLAG_COMPRESSED;
+    payload_size = dest_len;
+  } else {
+    memcpy(&buf[sizeof(header)], entries.data(), entries.size());
+  }
+  memcpy(&buf[0], &header, sizeof(header));
+  pub_sock->send(&buf[0], sizeof(header) + payload_size);
+}
+
+// Coalesces the messages of all services into one frame per window, one send instead of one per message
+static void msgq_to_zmq_batched(const std::set<std::string> &whitelist, uint64_t batch_ns, bool compress) {
+  Context *pub_context = new ZMQContext();
+  Context *sub_context = new MSGQContext();
+  Poller *poller = new MSGQPoller();
+
+  std::map<SubSocket*, std::string> sub2name;
+  for (auto endpoint : get_services(whitelist, false)) {
+    SubSocket *sub_sock = new MSGQSubSocket();
+    sub_sock->connect(sub_context, endpoint, "127.0.0.1", false);
+    poller->registerSocket(sub_sock);
+    sub2name[sub_sock] = endpoint;
+  }
+
+  PubSocket *pub_sock = new ZMQPubSocket();
+  pub_sock->connect(pub_context, BATCH_PORT, false);
+
+  std::string entries, buf;
+  uint32_t count = 0;
+  uint64_t batch_start = 0;
+  while (true) {
+    int timeout = 100;
+    if (count > 0) {
+      uint64_t elapsed = nanos_monotonic() - batch_start;
+      timeout = elapsed >= batch_ns ? 0 : (batch_ns - elapsed + 999999) / 1000000;
+    }
+
+    for (auto sub_sock : poller->poll(timeout)) {
+      const std::string &name = sub2name[sub_sock];
+      while (Message *msg = sub_sock->receive(true)) {
+        uint8_t name_len = name.size();
+        uint32_t size = msg->getSize();
+        size_t entry_size = sizeof(name_len) + name_len + sizeof(size) + size;
+        if (entry_size > MAX_BATCH_SIZE) {
+          std::cout << "dropping " << name << " message of " << size << " bytes, too big for a batch" << std::endl;
+          delete msg;
+          continue;
+        }
+        if (entries.size() + entry_size > MAX_BATCH_SIZE) {
+          send_batch(pub_sock, entries, count, compress, buf);
+          entries.clear();
+          count = 0;
+        }
+        if (count == 0) batch_start = nanos_monotonic();
+
+        entries.append((const char *)&name_len, sizeof(name_len));
+        entries.append(name);
+        entries.append((const char *)&size, sizeof(size));
+        entries.append(msg->getData(), size);
+        count++;
+        delete msg;
+      }
+    }
+
+    if (count > 0 && nanos_monotonic() - batch_start >= batch_ns) {
+      send_batch(pub_sock, entries, count, compress, buf);
+      entries.clear();
+      count = 0;
+    }
+  }
+}
+
+static void zmq_to_msgq_batched(const std::string &ip, const std::set<std::string> &whitelist) {
+  Context *pub_context = new MSGQContext();
+  Context *sub_context = new ZMQContext();
+
+  std::map<std::string, PubSocket*> pub_socks;
+  for (auto endpoint : get_services(whitelist, false)) {
+    PubSocket *pub_sock = new MSGQPubSocket();
+    pub_sock->connect(pub_context, endpoint);
+    pub_socks[endpoint] = pub_sock;
+  }
+
+  SubSocket *sub_sock = new ZMQSubSocket();
+  sub_sock->connect(sub_context, BATCH_PORT, ip, false, false);
+
+  std::string buf;
+  while (true) {
+    Message *msg = sub_sock->receive();
+    if (msg == NULL) continue;
+
+    BatchHeader header;
+    if (msg->getSize() < sizeof(header)) {
+      delete msg;
+      continue;
+    }
+    memcpy(&header, msg->getData(), sizeof(header));
+    if (header.magic != BATCH_MAGIC) {
+      std::cout << "invalid batch" << std::endl;
+      delete msg;
+      continue;
+    }
+
+    const char *payload = msg->getData() + sizeof(header);
+    size_t payload_size = msg->getSize() - sizeof(header);
+    if (header.flags & BATCH_FLAG_COMPRESSED) {
+      // raw_size comes off the network, the sender never makes a bigger batch
+      if (header.raw_size > MAX_BATCH_SIZE) {
+        std::cout << "batch too big: " << header.raw_size << std::endl;
+        delete msg;
+        continue;
+      }
+      buf.resize(header.raw_size);
+      uLongf dest_len = header.raw_size;
+      if (uncompress((Bytef *)&buf[0], &dest_len, (const Bytef *)payload, payload_size) != Z_OK || dest_len != header.raw_size) {
+        std::cout << "failed to decompress batch" << std::endl;
+        delete msg;
+        continue;
+      }
+      payload = buf.data();
+      payload_size = dest_len;
+    }
+
+    size_t pos = 0;
+    for (uint32_t i = 0; i < header.count; i++) {
+      if (pos + sizeof(uint8_t) > payload_size) break;
+      uint8_t name_len = payload[pos];
+      pos += sizeof(name_len);
+
+      uint32_t size;
+      if (pos + name_len + sizeof(size) > payload_size) break;
+      std::string name(payload + pos, name_len);
+      pos += name_len;
+      memcpy(&size, payload + pos, sizeof(size));
+      pos += sizeof(size);
+      if (pos + size > payload_size) break;
+
+      auto it = pub_socks.find(name);
+      if (it != pub_socks.end()) {
+        it->second->send((char *)payload + pos, size);
+      }
+      pos += size;
+    }
+    delete msg;
+  }
+}
+
+int main(int argc, char** argv) {
+  signal(SIGPIPE, (sighandler_t)sigpipe_handler);
+
+  bool batch = false, compress = false;
+  int batch_ms = DEFAULT_BATCH_MS;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--batch") {
+      batch = true;
+    } else if (arg == "--compress") {
+      compress = true;
+    } else if (arg == "--batch-ms" && i + 1 < argc) {
+      batch_ms = std::max(atoi(argv[++i]), 0);
+    } else {
+      args.push_back(arg);
+    }
+  }
+
+  bool zmq_to_msgq = args.size() >= 2;
+  std::string ip = zmq_to_msgq ? args[0] : "127.0.0.1";
+  std::set<std::string> whitelist;
+  if (zmq_to_msgq) {
+    whitelist = parse_whitelist(args[1]);
+  } else if (batch && args.size() == 1) {
+    whitelist = parse_whitelist(args[0]);
+  }
+
+  if (!batch) {
+    bridge_services(ip, whitelist, zmq_to_msgq);
+  } else if (zmq_to_msgq) {
+    zmq_to_msgq_batched(ip, whitelist);
+  } else {
+    msgq_to_zmq_batched(whitelist, batch_ms * 1000000ULL, compress);
+  }
   return 0;
 }
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iostream>
@@ -28,13 +29,53 @@ static bool service_exists(std::string path){
 static size_t get_size(std::string endpoint){
   size_t sz = DEFAULT_SEGMENT_SIZE;
 
-  if (endpoint == "roadCameraState" || endpoint == "driverCameraState" || endpoint == "wideRoadCameraState"){
-    sz *= 10;
+  for (const auto& it : services) {
+    if (it.name == endpoint) {
+      sz = it.segment_size;
+      break;
+    }
+  }
+
+  // Publishers and subscribers of a queue need to agree on the size
+  const char *env = std::getenv("MSGQ_SEGMENT_SIZE");
+  if (env != NULL){
+    char *end = NULL;
+    errno = 0;
+    unsigned long long env_sz = strtoull(env, &end, 10);
+    if (errno != 0 || end == env || *end != '\0' || env_sz < MIN_SEGMENT_SIZE || env_sz >= 0xFFFFFFFF - sizeof(msgq_header_t)){
+      std::cout << "Warning, ignoring invalid MSGQ_SEGMENT_SIZE: " << env << std::endl;
+    } else {
+      sz = env_sz;
+    }
   }
 
   return sz;
 }
 
+static size_t get_num_readers(std::string endpoint){
+  size_t n = DEFAULT_NUM_READERS;
+
+  for (const auto& it : services) {
+    if (it.name == endpoint) {
+      n = it.num_readers;
+      break;
+    }
+  }
+
+  const char *env = std::getenv("MSGQ_NUM_READERS");
+  if (env != NULL){
+    n = std::clamp(atoi(env), 1, MAX_READERS);
+  }
+
+  return n;
+}
+
+static bool get_trace_reads(std::string endpoint){
+  for (const auto& it : services) {
+    if (it.name == endpoint) return it.trace_reads;
+  }
+  return false;
+}
 
 MSGQContext::MSGQContext() {
 }
@@ -45,21 +86,30 @@ MSGQContext::~MSGQContext() {
 void MSGQMessage::init(size_t sz) {
   size = sz;
   data = new char[size];
+  owned = true;
 }
 
 void MSGQMessage::init(char * d, size_t sz) {
   size = sz;
   data = new char[size];
+  owned = true;
   memcpy(data, d, size);
 }
 
 void MSGQMessage::takeOwnership(char * d, size_t sz) {
   size = sz;
   data = d;
+  owned = true;
+}
+
+void MSGQMessage::borrow(char * d, size_t sz) {
+  size = sz;
+  data = d;
+  owned = false;
 }
 
 void MSGQMessage::close() {
-  if (size > 0){
+  if (size > 0 && owned){
     delete[] data;
   }
   size = 0;
@@ -95,7 +145,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
 }
 
 
-Message * MSGQSubSocket::receive(bool non_blocking){
+Message * MSGQSubSocket::receive(bool non_blocking, bool borrow){
   msgq_do_exit = 0;
 
   void (*prev_handler_sigint)(int);
@@ -109,7 +159,8 @@ Message * MSGQSubSocket::receive(bool non_blocking){
 
   MSGQMessage *r = NULL;
 
-  int rc = msgq_msg_recv(&msg, q);
+  auto recv = borrow ? msgq_msg_borrow : msgq_msg_recv;
+  int rc = recv(&msg, q);
 
   // Hack to implement blocking read with a poller. Don't use this
   while (!non_blocking && rc == 0 && msgq_do_exit == 0){
@@ -119,7 +170,7 @@ Message * MSGQSubSocket::receive(bool non_blocking){
     int t = (timeout != -1) ? timeout : 100;
 
     int n = msgq_poll(items, 1, t);
-    rc = msgq_msg_recv(&msg, q);
+    rc = recv(&msg, q);
 
     // The poll indicated a message was ready, but the receive failed. Try again
     if (n == 1 && rc == 0){
@@ -141,16 +192,24 @@ Message * MSGQSubSocket::receive(bool non_blocking){
 
   if (rc > 0){
     if (msgq_do_exit){
-      msgq_msg_close(&msg); // Free unused message on exit
+      if (!borrow) msgq_msg_close(&msg); // Free unused message on exit
     } else {
       r = new MSGQMessage;
-      r->takeOwnership(msg.data, msg.size);
+      if (borrow){
+        r->borrow(msg.data, msg.size);
+      } else {
+        r->takeOwnership(msg.data, msg.size);
+      }
     }
   }
 
   return (Message*)r;
 }
 
+bool MSGQSubSocket::borrowValid(){
+  return msgq_msg_borrow_valid(q);
+}
+
 void MSGQSubSocket::setTimeout(int t){
   timeout = t;
 }
@@ -175,7 +234,7 @@ int MSGQPubSocket::connect(Context *context, std::string endpoint, bool check_en
     return r;
   }
 
-  msgq_init_publisher(q);
+  msgq_init_publisher(q, get_num_readers(endpoint), get_trace_reads(endpoint));
 
   return 0;
 }
@@ -196,6 +255,14 @@ int MSGQPubSocket::send(char *data, size_t size){
   return msgq_msg_send(&msg, q);
 }
 
+char * MSGQPubSocket::reserve(size_t size){
+  return msgq_msg_reserve(q, size);
+}
+
+int MSGQPubSocket::commit(size_t size){
+  return msgq_msg_commit(q, size);
+}
+
 bool MSGQPubSocket::all_readers_updated() {
   return msgq_all_readers_updated(q);
 }
@@ -131,12 +131,41 @@ int ZMQPubSocket::send(char *data, size_t size){
   return zmq_send(sock, data, size, ZMQ_DONTWAIT);
 }
 
+char * ZMQPubSocket::reserve(size_t size){
+  if (reserved){
+    zmq_msg_close(&reserved_msg);
+  }
+  reserved = zmq_msg_init_size(&reserved_msg, size) == 0;
+  return reserved ? (char*)zmq_msg_data(&reserved_msg) : NULL;
+}
+
+int ZMQPubSocket::commit(size_t size){
+  assert(reserved);
+  reserved = false;
+
+  int r;
+  if (size == zmq_msg_size(&reserved_msg)){
+    // zmq_msg_send takes ownership of the message on success
+    r = zmq_msg_send(&reserved_msg, sock, ZMQ_DONTWAIT);
+    if (r >= 0){
+      return r;
+    }
+  } else {
+    r = zmq_send(sock, zmq_msg_data(&reserved_msg), size, ZMQ_DONTWAIT);
+  }
+  zmq_msg_close(&reserved_msg);
+  return r;
+}
+
 bool ZMQPubSocket::all_readers_updated() {
   assert(false); // TODO not implemented
   return false;
 }
 
 ZMQPubSocket::~ZMQPubSocket(){
+  if (reserved){
+    zmq_msg_close(&reserved_msg);
+  }
   zmq_close(sock);
 }
 
@@ -43,10 +43,14 @@ class ZMQPubSocket : public PubSocket {
 private:
   void * sock;
   std::string full_endpoint;
+  zmq_msg_t reserved_msg;
+  bool reserved = false;
 public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  char *reserve(size_t size);
+  int commit(size_t size);
   bool all_readers_updated();
   ~ZMQPubSocket();
 };
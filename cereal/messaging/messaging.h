@@ -1,9 +1,12 @@
 #pragma once
 #include <cstddef>
+#include <deque>
 #include <map>
+#include <queue>
 #include <string>
 #include <vector>
 #include <capnp/serialize.h>
+#include <kj/io.h>
 #include "../gen/cpp/log.capnp.h"
 
 #ifdef __APPLE__
@@ -37,6 +40,12 @@ public:
   virtual int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true) = 0;
   virtual void setTimeout(int timeout) = 0;
   virtual Message *receive(bool non_blocking=false) = 0;
+  // Zero-copy receive, the message can point directly into the socket's buffer.
+  // Its data is only usable until a receive on this socket returns a new message, and only while borrowValid() holds.
+  virtual Message *receiveBorrowed(bool non_blocking=false) { return receive(non_blocking); }
+  virtual bool borrowValid() { return true; }
+  // Number of times unread messages were lost because the publisher overtook this subscriber
+  virtual uint64_t getOverruns() { return 0; }
   virtual void * getRawSocket() = 0;
   static SubSocket * create();
   static SubSocket * create(Context * context, std::string endpoint, std::string address="127.0.0.1", bool conflate=false, bool check_endpoint=true);
@@ -48,6 +57,9 @@ public:
   virtual int connect(Context *context, std::string endpoint, bool check_endpoint=true) = 0;
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
+  // Two-phase send, fill the buffer returned by reserve and publish it with commit
+  virtual char *reserve(size_t size) = 0;
+  virtual int commit(size_t size) = 0;
   virtual bool all_readers_updated() = 0;
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint, bool check_endpoint=true);
@@ -66,8 +78,11 @@ public:
 
 class SubMaster {
 public:
-  SubMaster(const std::vector<const char *> &service_list,
-            const char *address = nullptr, const std::vector<const char *> &ignore_alive = {});
+  // Services in borrowed are read in place in the msgq segment instead of copied. Their events
+  // are only safe to use while intact() holds, and turn invalid on the update after they were overwritten.
+  SubMaster(const std::vector<const char *> &service_list, const char *address = nullptr,
+            const std::vector<const char *> &ignore_alive = {}, const std::vector<const char *> &lossless = {},
+            const std::vector<const char *> &borrowed = {});
   void update(int timeout = 1000);
   void update_msgs(uint64_t current_time, const std::vector<std::pair<std::string, cereal::Event::Reader>> &messages);
   inline bool allAlive(const std::vector<const char *> &service_list = {}) { return all_(service_list, false, true); }
@@ -82,9 +97,17 @@ public:
   bool valid(const char *name) const;
   uint64_t rcv_frame(const char *name) const;
   uint64_t rcv_time(const char *name) const;
+  // False if the publisher has overwritten the borrowed message since it was received
+  bool intact(const char *name) const;
   cereal::Event::Reader &operator[](const char *name) const;
+  // All messages received by the last update, oldest first. Services in lossless get
+  // every queued message, up to one second worth, the others at most the latest one.
+  const std::vector<cereal::Event::Reader> &batch(const char *name) const;
+  uint64_t dropped(const char *name) const;
+  uint64_t overruns(const char *name) const;
 
 private:
+  friend class MessageMerger;
   bool all_(const std::vector<const char *> &service_list, bool valid, bool alive);
   Poller *poller_ = nullptr;
   struct SubMessage;
@@ -92,9 +115,58 @@ private:
   std::map<std::string, SubMessage *> services_;
 };
 
+// Merges several services into a single stream in logMonoTime order. A message is held back
+// until a message at least reorder_window_ns newer was received, so late publishers still end up in order.
+// Reads through a SubMaster with all services lossless, which also keeps track of alive and valid.
+class MessageMerger {
+public:
+  MessageMerger(const std::vector<const char *> &service_list, uint64_t reorder_window_ns = 50 * 1000000ULL,
+                const char *address = nullptr, const std::vector<const char *> &ignore_alive = {});
+  // Receives everything that's pending, waits up to timeout ms if nothing is
+  void update(int timeout = 1000);
+  // Next message in order, valid until the following call. flush ignores the reorder window
+  inline bool next(cereal::Event::Reader &event, bool flush = false) { return next(event, flush ? UINT64_MAX : 0); }
+  // Same, but only messages up to flush_until (logMonoTime) ignore the reorder window
+  bool next(cereal::Event::Reader &event, uint64_t flush_until);
+  inline size_t pending() const { return num_pending_; }
+  // logMonoTime of the newest pending message of a service, 0 if there is none
+  uint64_t newest(const char *name) const;
+  inline bool alive(const char *name) const { return sm_.alive(name); }
+  inline bool valid(const char *name) const { return sm_.valid(name); }
+  inline bool allAliveAndValid(const std::vector<const char *> &service_list = {}) { return sm_.allAliveAndValid(service_list); }
+  inline uint64_t dropped(const char *name) const { return sm_.dropped(name); }
+  inline uint64_t overruns(const char *name) const { return sm_.overruns(name); }
+  ~MessageMerger();
+
+private:
+  struct Entry {
+    uint64_t mono_time;
+    Message *msg;
+  };
+  struct Head {
+    uint64_t mono_time;
+    size_t idx;
+    bool operator>(const Head &other) const { return mono_time > other.mono_time; }
+  };
+
+  SubMaster sm_;
+  uint64_t reorder_window_;
+  uint64_t newest_ = 0;
+  size_t num_pending_ = 0;
+  std::vector<SubMaster::SubMessage *> services_;
+  std::vector<std::deque<Entry>> queues_;
+  std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads_;
+  Message *current_msg_ = nullptr;
+  void *allocated_msg_reader_ = nullptr;
+  capnp::FlatArrayMessageReader *msg_reader_ = nullptr;
+};
+
 class MessageBuilder : public capnp::MallocMessageBuilder {
 public:
   MessageBuilder() = default;
+  // Builds in first_segment, which must be zeroed and is zeroed again on destruction, so
+  // a message that fits doesn't allocate and the segment can be reused for the next one
+  MessageBuilder(kj::ArrayPtr<capnp::word> first_segment) : capnp::MallocMessageBuilder(first_segment) {}
 
   cereal::Event::Builder initEvent(bool valid = true) {
     cereal::Event::Builder event = initRoot<cereal::Event>();
@@ -111,6 +183,16 @@ public:
     return heapArray_.asBytes();
   }
 
+  size_t getSerializedSize() {
+    return capnp::computeSerializedSizeInWords(*this) * sizeof(capnp::word);
+  }
+
+  // Serializes into a caller provided buffer of getSerializedSize() bytes
+  void serializeTo(kj::ArrayPtr<capnp::byte> buf) {
+    kj::ArrayOutputStream stream(buf);
+    capnp::writeMessage(stream, *this);
+  }
+
 private:
   kj::Array<capnp::word> heapArray_;
 };
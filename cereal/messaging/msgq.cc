@@ -7,7 +7,7 @@
 #include <chrono>
 #include <algorithm>
 #include <cstdlib>
-#include <csignal>
+#include <climits>
 #include <random>
 
 #include <poll.h>
@@ -18,13 +18,51 @@
 #include <sys/syscall.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
 
 #include <stdio.h>
 
 #include "msgq.h"
 
-void sigusr2_handler(int signal) {
-  assert(signal == SIGUSR2);
+#ifdef __linux__
+#ifndef SYS_futex_waitv
+#define SYS_futex_waitv 449
+#endif
+#ifndef FUTEX_32
+#define FUTEX_32 2
+#endif
+
+// Mirrors struct futex_waitv from linux/futex.h, which older kernel headers don't have
+struct msgq_futex_waitv {
+  uint64_t val;
+  uint64_t uaddr;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+static std::atomic<bool> futex_waitv_supported(true);
+#endif
+
+// Without futex_waitv only the first polled queue can wake us up,
+// the other queues are rechecked at this interval
+#define MSGQ_POLL_FALLBACK_NS (1000ULL * 1000ULL)
+
+static uint64_t msgq_monotonic_ns(){
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static uint64_t msgq_boottime_ns(){
+  struct timespec t;
+#ifdef __APPLE__
+  clock_gettime(CLOCK_MONOTONIC, &t);
+#else
+  clock_gettime(CLOCK_BOOTTIME, &t);
+#endif
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
 }
 
 uint64_t msgq_get_uid(void){
@@ -67,14 +105,47 @@ int msgq_msg_close(msgq_msg_t * msg){
   return 0;
 }
 
+static void msgq_notify(msgq_queue_t * q);
+
+static inline void msgq_stat_add(uint64_t * counter, uint64_t n = 1){
+  reinterpret_cast<std::atomic<uint64_t>*>(counter)->fetch_add(n, std::memory_order_relaxed);
+}
+
+// The first reader past a message stamps the time, for the publisher to measure how long
+// its messages wait. Packed pointers only grow, so a lagging reader doesn't move it back.
+// Only done on queues whose publisher asked for it, the others skip the shared cache line.
+static inline void msgq_stat_first_read(msgq_queue_t *q, uint64_t read_pointer){
+  if (!q->trace_reads->load(std::memory_order_relaxed)) return;
+
+  auto *first = reinterpret_cast<std::atomic<uint64_t>*>(&q->stats->first_read_pointer);
+  uint64_t prev = first->load(std::memory_order_relaxed);
+  while (prev < read_pointer){
+    if (first->compare_exchange_weak(prev, read_pointer)){
+      reinterpret_cast<std::atomic<uint64_t>*>(&q->stats->first_read_ns)->store(msgq_boottime_ns(), std::memory_order_release);
+      break;
+    }
+  }
+}
+
 void msgq_reset_reader(msgq_queue_t * q){
   int id = q->reader_id;
+  msgq_stat_add(&q->stats->resets);
+  // Whatever was borrowed could have been overwritten
+  q->borrowed = false;
+  q->read_borrows[id]->store(NO_BORROW);
   q->read_valids[id]->store(true);
   q->read_pointers[id]->store(*q->write_pointer);
 }
 
+// The publisher overwrote data we didn't read yet, skip ahead to the latest message
+static void msgq_reader_overrun(msgq_queue_t * q){
+  q->num_overruns++;
+  q->read_overruns[q->reader_id]->fetch_add(1, std::memory_order_relaxed);
+  msgq_reset_reader(q);
+}
+
 void msgq_wait_for_subscriber(msgq_queue_t *q){
-  while (*q->num_readers == 0){
+  while (*q->reader_mask == 0){
     ;
   }
 
@@ -84,7 +155,6 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
 
 int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
-  std::signal(SIGUSR2, sigusr2_handler);
 
   const char * prefix = "/dev/shm/";
   char * full_path = new char[strlen(path) + strlen(prefix) + 1];
@@ -99,10 +169,21 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   }
   delete[] full_path;
 
-  int rc = ftruncate(fd, size + sizeof(msgq_header_t));
-  if (rc < 0){
-    close(fd);
-    return -1;
+  // An existing segment keeps its size, resizing it would break processes that have it mapped.
+  // The publisher replaces one that is too small in msgq_init_publisher
+  const size_t requested_size = size;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(msgq_header_t)){
+    size = st.st_size - sizeof(msgq_header_t);
+    if (size != requested_size){
+      std::cout << "Warning, " << path << " segment is " << size << " bytes, expected " << requested_size << std::endl;
+    }
+  } else {
+    int rc = ftruncate(fd, size + sizeof(msgq_header_t));
+    if (rc < 0){
+      close(fd);
+      return -1;
+    }
   }
   char * mem = (char*)mmap(NULL, size + sizeof(msgq_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   close(fd);
@@ -115,99 +196,189 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   msgq_header_t *header = (msgq_header_t *)mem;
 
   // Setup pointers to header segment
-  q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
+  q->max_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->max_readers);
+  q->reader_mask = reinterpret_cast<std::atomic<uint64_t>*>(&header->reader_mask);
   q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
   q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
-
-  for (size_t i = 0; i < NUM_READERS; i++){
+  q->write_seq = reinterpret_cast<std::atomic<uint32_t>*>(&header->write_seq);
+  q->num_waiters = reinterpret_cast<std::atomic<uint32_t>*>(&header->num_waiters);
+  q->max_lag = reinterpret_cast<std::atomic<uint64_t>*>(&header->max_lag);
+  q->trace_reads = reinterpret_cast<std::atomic<uint64_t>*>(&header->trace_reads);
+  q->replaced = reinterpret_cast<std::atomic<uint64_t>*>(&header->replaced);
+  q->stats = &header->stats;
+
+  for (size_t i = 0; i < MAX_READERS; i++){
     q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
     q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
     q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
+    q->read_borrows[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_borrows[i]);
+    q->read_overruns[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_overruns[i]);
   }
 
   q->data = mem + sizeof(msgq_header_t);
   q->size = size;
+  q->requested_size = requested_size;
   q->reader_id = -1;
 
   q->endpoint = path;
   q->read_conflate = false;
+  q->borrowed = false;
+  q->reserved_size = 0;
+  q->num_overruns = 0;
 
   return 0;
 }
 
 void msgq_close_queue(msgq_queue_t *q){
+  // Give our reader slot back, unless we were already evicted
+  int id = q->reader_id;
+  if (id >= 0){
+    uint64_t uid = q->read_uid_local;
+    if (q->read_uids[id]->compare_exchange_strong(uid, 0)){
+      *q->read_valids[id] = false;
+      *q->read_borrows[id] = NO_BORROW;
+      q->reader_mask->fetch_and(~(1ULL << id));
+    }
+  }
+
   if (q->mmap_p != NULL){
     munmap(q->mmap_p, q->size + sizeof(msgq_header_t));
   }
 }
 
 
-void msgq_init_publisher(msgq_queue_t * q) {
+// Moves the queue to a new segment of the requested size. The old one is unlinked, processes
+// that still have it mapped are evicted and see it marked as replaced
+static void msgq_replace_segment(msgq_queue_t * q, uint64_t uid){
+  std::cout << "Recreating " << q->endpoint << " segment with " << q->requested_size << " bytes" << std::endl;
+
+  *q->write_uid = uid; // An old publisher stops writing to it
+  *q->replaced = true;
+  *q->reader_mask = 0;
+  for (size_t i = 0; i < MAX_READERS; i++){
+    *q->read_valids[i] = false;
+    *q->read_uids[i] = 0;
+  }
+  msgq_notify(q);
+
+  std::string full_path = "/dev/shm/" + q->endpoint;
+  unlink(full_path.c_str());
+
+  msgq_queue_t fresh;
+  if (msgq_new_queue(&fresh, q->endpoint.c_str(), q->requested_size) != 0){
+    std::cout << "Warning, could not recreate " << full_path << std::endl;
+    return;
+  }
+  munmap(q->mmap_p, q->size + sizeof(msgq_header_t));
+  *q = fresh;
+}
+
+// Called by a reader after it was evicted, follows the queue to a new segment if it was replaced
+static void msgq_reconnect(msgq_queue_t * q){
+  if (*q->replaced){
+    std::cout << q->endpoint << ": Segment was replaced, reopening" << std::endl;
+
+    msgq_queue_t fresh;
+    if (msgq_new_queue(&fresh, q->endpoint.c_str(), q->requested_size) == 0){
+      fresh.read_conflate = q->read_conflate;
+      fresh.num_overruns = q->num_overruns;
+      munmap(q->mmap_p, q->size + sizeof(msgq_header_t));
+      *q = fresh;
+    }
+  }
+
+  msgq_init_subscriber(q);
+}
+
+void msgq_init_publisher(msgq_queue_t * q, size_t max_readers, bool trace_reads) {
   //std::cout << "Starting publisher" << std::endl;
+  assert(max_readers > 0 && max_readers <= MAX_READERS);
   uint64_t uid = msgq_get_uid();
 
+  if (q->size < q->requested_size){
+    msgq_replace_segment(q, uid);
+  }
+
   *q->write_uid = uid;
-  *q->num_readers = 0;
+  *q->max_readers = max_readers;
+  *q->reader_mask = 0;
+  *q->max_lag = 0;
+  *q->trace_reads = trace_reads;
+  memset(q->stats, 0, sizeof(msgq_stats_t));
 
-  for (size_t i = 0; i < NUM_READERS; i++){
+  for (size_t i = 0; i < MAX_READERS; i++){
     *q->read_valids[i] = false;
     *q->read_uids[i] = 0;
+    *q->read_borrows[i] = NO_BORROW;
   }
 
   q->write_uid_local = uid;
 }
 
-static void thread_signal(uint32_t tid) {
-  #ifndef SYS_tkill
-    // TODO: this won't work for multithreaded programs
-    kill(tid, SIGUSR2);
-  #else
-    syscall(SYS_tkill, tid, SIGUSR2);
+static void msgq_notify(msgq_queue_t * q) {
+  // Bump the sequence number before checking for waiters, a reader that registers
+  // after this will see the new sequence number and not go to sleep
+  q->write_seq->fetch_add(1);
+
+  #ifdef __linux__
+    if (*q->num_waiters > 0){
+      syscall(SYS_futex, q->write_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
   #endif
 }
 
 void msgq_init_subscriber(msgq_queue_t * q) {
   assert(q != NULL);
-  assert(q->num_readers != NULL);
+  assert(q->reader_mask != NULL);
 
   uint64_t uid = msgq_get_uid();
 
   // Get reader id
   while (true){
-    uint64_t cur_num_readers = *q->num_readers;
-    uint64_t new_num_readers = cur_num_readers + 1;
+    uint64_t cur_mask = *q->reader_mask;
+
+    // Without a publisher the size of the reader table is not known yet
+    uint64_t max_readers = *q->max_readers;
+    if (max_readers == 0 || max_readers > MAX_READERS){
+      max_readers = MAX_READERS;
+    }
+    uint64_t slots = (max_readers == 64) ? ~0ULL : ((1ULL << max_readers) - 1);
+    uint64_t free_slots = slots & ~cur_mask;
 
     // No more slots available. Reset all subscribers to kick out inactive ones
-    if (new_num_readers > NUM_READERS){
+    if (free_slots == 0){
       std::cout << "Warning, evicting all subscribers!" << std::endl;
-      *q->num_readers = 0;
+      msgq_stat_add(&q->stats->evictions, __builtin_popcountll(cur_mask));
+      *q->reader_mask = 0;
 
-      for (size_t i = 0; i < NUM_READERS; i++){
+      for (size_t i = 0; i < MAX_READERS; i++){
         *q->read_valids[i] = false;
-
-        uint64_t old_uid = *q->read_uids[i];
         *q->read_uids[i] = 0;
-
-        // Wake up reader in case they are in a poll
-        thread_signal(old_uid & 0xFFFFFFFF);
+        *q->read_borrows[i] = NO_BORROW;
       }
 
+      // Wake up readers in case they are in a poll
+      msgq_notify(q);
+
       continue;
     }
 
     // Use atomic compare and swap to handle race condition
     // where two subscribers start at the same time
-    if (std::atomic_compare_exchange_strong(q->num_readers,
-                                            &cur_num_readers,
-                                            new_num_readers)){
-      q->reader_id = cur_num_readers;
+    int id = __builtin_ctzll(free_slots);
+    if (std::atomic_compare_exchange_strong(q->reader_mask,
+                                            &cur_mask,
+                                            cur_mask | (1ULL << id))){
+      q->reader_id = id;
       q->read_uid_local = uid;
 
       // We start with read_valid = false,
       // on the first read the read pointer will be synchronized with the write pointer
-      *q->read_valids[cur_num_readers] = false;
-      *q->read_pointers[cur_num_readers] = 0;
-      *q->read_uids[cur_num_readers] = uid;
+      *q->read_valids[id] = false;
+      *q->read_pointers[id] = 0;
+      *q->read_borrows[id] = NO_BORROW;
+      *q->read_overruns[id] = 0;
+      *q->read_uids[id] = uid;
       break;
     }
   }
@@ -216,21 +387,25 @@ void msgq_init_subscriber(msgq_queue_t * q) {
   msgq_reset_reader(q);
 }
 
-int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+char * msgq_msg_reserve(msgq_queue_t *q, size_t size){
   // Die if we are no longer the active publisher
   if (q->write_uid_local != *q->write_uid){
     std::cout << "Killing old publisher: " << q->endpoint << std::endl;
     errno = EADDRINUSE;
-    return -1;
+    return NULL;
   }
 
-  uint64_t total_msg_size = ALIGN(msg->size + sizeof(int64_t));
+  uint64_t total_msg_size = ALIGN(size + sizeof(int64_t));
 
   // We need to fit at least three messages in the queue,
   // then we can always safely access the last message
-  assert(3 * total_msg_size <= q->size);
+  if (3 * total_msg_size > q->size){
+    std::cout << q->endpoint << ": Message of " << size << " bytes doesn't fit in the segment" << std::endl;
+    errno = EMSGSIZE;
+    return NULL;
+  }
 
-  uint64_t num_readers = *q->num_readers;
+  uint64_t reader_mask = *q->reader_mask;
 
   uint32_t write_cycles, write_pointer;
   UNPACK64(write_cycles, write_pointer, *q->write_pointer);
@@ -246,13 +421,17 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
 
     // Invalidate all readers that are beyond the write pointer
     // TODO: should we handle the case where a new reader shows up while this is running?
-    for (uint64_t i = 0; i < num_readers; i++){
-      uint64_t read_pointer = *q->read_pointers[i];
-      uint64_t read_cycles = read_pointer >> 32;
-      read_pointer &= 0xFFFFFFFF;
+    for (uint64_t mask = reader_mask; mask != 0; mask &= mask - 1){
+      int i = __builtin_ctzll(mask);
+      for (uint64_t pointer : {(uint64_t)*q->read_pointers[i], (uint64_t)*q->read_borrows[i]}){
+        if (pointer == NO_BORROW) continue;
 
-      if ((read_pointer > write_pointer) && (read_cycles != write_cycles)) {
-        *q->read_valids[i] = false;
+        uint32_t read_cycles, read_pointer;
+        UNPACK64(read_cycles, read_pointer, pointer);
+
+        if ((read_pointer > write_pointer) && (read_cycles != write_cycles) && q->read_valids[i]->exchange(false)) {
+          msgq_stat_add(&q->stats->invalidations);
+        }
       }
     }
 
@@ -260,6 +439,7 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
     write_pointer = 0;
     write_cycles = write_cycles + 1;
     PACK64(*q->write_pointer, write_cycles, write_pointer);
+    msgq_stat_add(&q->stats->wraparounds);
 
     // Set actual pointer to the beginning of the data segment
     p = q->data;
@@ -267,37 +447,63 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
 
   // Invalidate readers that are in the area that will be written
   uint64_t start = write_pointer;
-  uint64_t end = ALIGN(start + sizeof(int64_t) + msg->size);
+  uint64_t end = ALIGN(start + sizeof(int64_t) + size);
 
-  for (uint64_t i = 0; i < num_readers; i++){
-    uint32_t read_cycles, read_pointer;
-    UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
+  // A borrowed message is protected by its start, writes are contiguous so that's always overwritten first
+  for (uint64_t mask = reader_mask; mask != 0; mask &= mask - 1){
+    int i = __builtin_ctzll(mask);
+    for (uint64_t pointer : {(uint64_t)*q->read_pointers[i], (uint64_t)*q->read_borrows[i]}){
+      if (pointer == NO_BORROW) continue;
 
-    if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
-      *q->read_valids[i] = false;
+      uint32_t read_cycles, read_pointer;
+      UNPACK64(read_cycles, read_pointer, pointer);
+
+      if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles) && q->read_valids[i]->exchange(false)) {
+        msgq_stat_add(&q->stats->invalidations);
+      }
     }
   }
 
+  q->reserved_size = size;
+  return p + sizeof(int64_t);
+}
+
+int msgq_msg_commit(msgq_queue_t *q, size_t size){
+  assert(size <= q->reserved_size); // Readers were only invalidated for the reserved area
+  q->reserved_size = 0;
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  char *p = q->data + write_pointer;
 
   // Write size tag
   std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
-  *size_p = msg->size;
-
-  // Copy data
-  memcpy(p + sizeof(int64_t), msg->data, msg->size);
+  *size_p = size;
   __sync_synchronize();
 
   // Update write pointer
-  uint32_t new_ptr = ALIGN(write_pointer + msg->size + sizeof(int64_t));
+  uint32_t new_ptr = ALIGN(write_pointer + size + sizeof(int64_t));
   PACK64(*q->write_pointer, write_cycles, new_ptr);
+  msgq_stat_add(&q->stats->msgs_sent);
+  msgq_stat_add(&q->stats->bytes_sent, size);
 
   // Notify readers
-  for (uint64_t i = 0; i < num_readers; i++){
-    uint64_t reader_uid = *q->read_uids[i];
-    thread_signal(reader_uid & 0xFFFFFFFF);
+  msgq_notify(q);
+
+  return size;
+}
+
+int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+  char *p = msgq_msg_reserve(q, msg->size);
+  if (p == NULL){
+    return -1;
   }
 
-  return msg->size;
+  // Copy data
+  memcpy(p, msg->data, msg->size);
+
+  return msgq_msg_commit(q, msg->size);
 }
 
 
@@ -308,13 +514,13 @@ int msgq_msg_ready(msgq_queue_t * q){
 
   if (q->read_uid_local != *q->read_uids[id]){
     std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
-    msgq_init_subscriber(q);
+    msgq_reconnect(q);
     goto start;
   }
 
   // Check valid
   if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+    msgq_reader_overrun(q);
     goto start;
   }
 
@@ -328,20 +534,20 @@ int msgq_msg_ready(msgq_queue_t * q){
   return (read_pointer != write_pointer);
 }
 
-int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+static int msgq_msg_recv_internal(msgq_msg_t * msg, msgq_queue_t * q, bool borrow){
  start:
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
 
   if (q->read_uid_local != *q->read_uids[id]){
     std::cout << q->endpoint << ": Reader was evicted, reconnecting" << std::endl;
-    msgq_init_subscriber(q);
+    msgq_reconnect(q);
     goto start;
   }
 
   // Check valid
   if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+    msgq_reader_overrun(q);
     goto start;
   }
 
@@ -359,13 +565,23 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     return 0;
   }
 
+  // The previously borrowed message is released once there is a new one
+  if (q->borrowed){
+    msgq_msg_release(q);
+  }
+
+  // Keep track of how far behind readers get, for sizing the segment
+  uint64_t lag = (read_cycles == write_cycles) ? write_pointer - read_pointer : q->size - read_pointer + write_pointer;
+  uint64_t max_lag = *q->max_lag;
+  while (lag > max_lag && !q->max_lag->compare_exchange_weak(max_lag, lag)) {}
+
   // Read potential message size
   std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
   std::int64_t size = *size_p;
 
   // Check if the size that was read is valid
   if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+    msgq_reader_overrun(q);
     goto start;
   }
 
@@ -392,6 +608,28 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     }
   }
 
+  if (borrow){
+    // Protect the message by its start before moving the read pointer past it,
+    // from now on the publisher invalidates this reader when overwriting the message
+    PACK64(*q->read_borrows[id], read_cycles, read_pointer);
+    q->borrowed = true;
+    __sync_synchronize();
+
+    // Update read pointer
+    PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+
+    // Check if the message was overwritten before it was protected
+    if (!*q->read_valids[id]){
+      msgq_reader_overrun(q);
+      goto start;
+    }
+
+    msg->data = p + sizeof(int64_t);
+    msg->size = size;
+    msgq_stat_first_read(q, *q->read_pointers[id]);
+    return msg->size;
+  }
+
   // Copy message
   if (msgq_msg_init_size(msg, size) < 0)
     return -1;
@@ -406,59 +644,143 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   // Check if the actual data that was copied is valid
   if (!*q->read_valids[id]){
     msgq_msg_close(msg);
-    msgq_reset_reader(q);
+    msgq_reader_overrun(q);
     goto start;
   }
 
-
+  msgq_stat_first_read(q, *q->read_pointers[id]);
   return msg->size;
 }
 
+int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+  return msgq_msg_recv_internal(msg, q, false);
+}
 
+int msgq_msg_borrow(msgq_msg_t * msg, msgq_queue_t * q){
+  return msgq_msg_recv_internal(msg, q, true);
+}
 
-int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
-  int num = 0;
+bool msgq_msg_borrow_valid(msgq_queue_t * q){
+  int id = q->reader_id;
+  return q->borrowed && q->read_uid_local == *q->read_uids[id] && *q->read_valids[id];
+}
+
+bool msgq_msg_release(msgq_queue_t * q){
+  bool valid = msgq_msg_borrow_valid(q);
+
+  // After an eviction the slot belongs to another reader
+  if (q->borrowed && q->read_uid_local == *q->read_uids[q->reader_id]){
+    *q->read_borrows[q->reader_id] = NO_BORROW;
+  }
+  q->borrowed = false;
+
+  return valid;
+}
+
+
+static void msgq_wait(msgq_pollitem_t * items, const uint32_t * seqs, size_t nitems, uint64_t deadline){
+  uint64_t now = msgq_monotonic_ns();
+  if (now >= deadline){
+    return;
+  }
+  uint64_t remaining = deadline - now;
+
+#ifdef __linux__
+  if (nitems > 1 && nitems <= MSGQ_MAX_POLL_ITEMS && futex_waitv_supported){
+    struct msgq_futex_waitv waiters[MSGQ_MAX_POLL_ITEMS] = {};
+    for (size_t i = 0; i < nitems; i++){
+      waiters[i].val = seqs[i];
+      waiters[i].uaddr = (uintptr_t)items[i].q->write_seq;
+      waiters[i].flags = FUTEX_32;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000ULL;
+    ts.tv_nsec = deadline % 1000000000ULL;
+
+    long ret = syscall(SYS_futex_waitv, waiters, nitems, 0, &ts, CLOCK_MONOTONIC);
+    if (ret != -1 || errno != ENOSYS){
+      return;
+    }
+    futex_waitv_supported = false;
+  }
+#endif
 
-  // Check if messages ready
-  for (size_t i = 0; i < nitems; i++) {
-    items[i].revents = msgq_msg_ready(items[i].q);
-    if (items[i].revents) num++;
+  if (nitems > 1){
+    remaining = std::min<uint64_t>(remaining, MSGQ_POLL_FALLBACK_NS);
   }
 
-  int ms = (timeout == -1) ? 100 : timeout;
   struct timespec ts;
-  ts.tv_sec = ms / 1000;
-  ts.tv_nsec = (ms % 1000) * 1000 * 1000;
+  ts.tv_sec = remaining / 1000000000ULL;
+  ts.tv_nsec = remaining % 1000000000ULL;
+
+#ifdef __linux__
+  // Returns immediately if a publisher bumped the sequence number after we took the snapshot
+  syscall(SYS_futex, items[0].q->write_seq, FUTEX_WAIT, seqs[0], &ts, NULL, 0);
+#else
+  nanosleep(&ts, NULL);
+#endif
+}
 
+int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
+  int num = 0;
 
-  while (num == 0) {
-    int ret;
+  // Without a timeout we wake up periodically, same as a timeout of 100 ms
+  uint64_t ms = (timeout == -1) ? 100 : timeout;
+  uint64_t deadline = msgq_monotonic_ns() + ms * 1000ULL * 1000ULL;
 
-    ret = nanosleep(&ts, &ts);
+  uint32_t seqs[MSGQ_MAX_POLL_ITEMS];
+  size_t nwait = std::min(nitems, (size_t)MSGQ_MAX_POLL_ITEMS);
+
+  while (true) {
+    // Register as waiter and take a snapshot of the sequence numbers before checking
+    // the queues, a message published in between will make the wait return immediately
+    for (size_t i = 0; i < nwait; i++) {
+      items[i].q->num_waiters->fetch_add(1);
+      seqs[i] = *items[i].q->write_seq;
+    }
 
     // Check if messages ready
     for (size_t i = 0; i < nitems; i++) {
-      if (items[i].revents == 0 && msgq_msg_ready(items[i].q)){
-        num += 1;
-        items[i].revents = 1;
-      }
+      items[i].revents = msgq_msg_ready(items[i].q);
+      if (items[i].revents) num++;
     }
 
-    // exit if we had a timeout and the sleep finished
-    if (timeout != -1 && ret == 0){
+    if (num == 0 && nwait > 0) {
+      msgq_wait(items, seqs, nwait, deadline);
+    }
+
+    for (size_t i = 0; i < nwait; i++) {
+      items[i].q->num_waiters->fetch_sub(1);
+    }
+
+    if (num > 0) {
       break;
     }
+
+    if (msgq_monotonic_ns() >= deadline) {
+      // exit if we had a timeout, otherwise keep waiting
+      if (timeout != -1) {
+        for (size_t i = 0; i < nitems; i++) {
+          items[i].revents = msgq_msg_ready(items[i].q);
+          if (items[i].revents) num++;
+        }
+        break;
+      }
+      deadline = msgq_monotonic_ns() + ms * 1000ULL * 1000ULL;
+    }
   }
 
   return num;
 }
 
 bool msgq_all_readers_updated(msgq_queue_t *q) {
-  uint64_t num_readers = *q->num_readers;
-  for (uint64_t i = 0; i < num_readers; i++) {
+  uint64_t reader_mask = *q->reader_mask;
+  for (uint64_t mask = reader_mask; mask != 0; mask &= mask - 1) {
+    int i = __builtin_ctzll(mask);
     if (*q->read_valids[i] && *q->write_pointer != *q->read_pointers[i]) {
       return false;
     }
   }
-  return num_readers > 0;
+  return reader_mask != 0;
 }
@@ -5,36 +5,74 @@
 #include <atomic>
 
 #define DEFAULT_SEGMENT_SIZE (10 * 1024 * 1024)
-#define NUM_READERS 10
+#define MIN_SEGMENT_SIZE (64 * 1024) // Smallest size accepted from MSGQ_SEGMENT_SIZE
+#define MAX_READERS 64 // Capacity of the reader table, one bit per slot in reader_mask
+#define DEFAULT_NUM_READERS 32
+#define MSGQ_MAX_POLL_ITEMS 128 // FUTEX_WAITV_MAX
+#define NO_BORROW UINT64_MAX
 #define ALIGN(n) ((n + (8 - 1)) & -8)
 
 #define UNPACK64(higher, lower, input) do {uint64_t tmp = input; higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
 #define PACK64(output, higher, lower) output = ((uint64_t)higher << 32 ) | ((uint64_t)lower & 0xFFFFFFFF)
 
+// Lock-free counters kept in the segment header, for msgq_stats
+struct msgq_stats_t {
+  uint64_t msgs_sent;
+  uint64_t bytes_sent;
+  uint64_t wraparounds;
+  uint64_t invalidations; // Readers invalidated because the publisher overwrote unread data
+  uint64_t resets; // Read pointers moved to the write pointer, on subscribe and after an invalidation
+  uint64_t evictions; // Readers kicked out because the reader table was full
+  uint64_t first_read_pointer; // Write pointer after the newest message a reader received, if trace_reads is set
+  uint64_t first_read_ns; // When the first reader received it, CLOCK_BOOTTIME
+};
+
 struct  msgq_header_t {
-  uint64_t num_readers;
+  uint64_t max_readers; // Reader slots in use for this queue, set by the publisher
+  uint64_t reader_mask; // Bitmap of active reader slots
   uint64_t write_pointer;
   uint64_t write_uid;
-  uint64_t read_pointers[NUM_READERS];
-  uint64_t read_valids[NUM_READERS];
-  uint64_t read_uids[NUM_READERS];
+  uint32_t write_seq; // futex word, bumped on every publish
+  uint32_t num_waiters;
+  uint64_t max_lag; // High-water mark of unread bytes seen by any reader
+  uint64_t trace_reads; // Set by the publisher, readers only stamp the first read stats when set
+  uint64_t replaced; // Set when a publisher moved the queue to a new segment, readers reopen it
+  msgq_stats_t stats;
+  uint64_t read_pointers[MAX_READERS];
+  uint64_t read_valids[MAX_READERS];
+  uint64_t read_uids[MAX_READERS];
+  uint64_t read_borrows[MAX_READERS];
+  uint64_t read_overruns[MAX_READERS]; // Invalidations per reader slot, reset when the slot is claimed
 };
 
 struct msgq_queue_t {
-  std::atomic<uint64_t> *num_readers;
+  std::atomic<uint64_t> *max_readers;
+  std::atomic<uint64_t> *reader_mask;
   std::atomic<uint64_t> *write_pointer;
   std::atomic<uint64_t> *write_uid;
-  std::atomic<uint64_t> *read_pointers[NUM_READERS];
-  std::atomic<uint64_t> *read_valids[NUM_READERS];
-  std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::atomic<uint32_t> *write_seq;
+  std::atomic<uint32_t> *num_waiters;
+  std::atomic<uint64_t> *max_lag;
+  std::atomic<uint64_t> *trace_reads;
+  std::atomic<uint64_t> *replaced;
+  msgq_stats_t *stats;
+  std::atomic<uint64_t> *read_pointers[MAX_READERS];
+  std::atomic<uint64_t> *read_valids[MAX_READERS];
+  std::atomic<uint64_t> *read_uids[MAX_READERS];
+  std::atomic<uint64_t> *read_borrows[MAX_READERS];
+  std::atomic<uint64_t> *read_overruns[MAX_READERS];
   char * mmap_p;
   char * data;
   size_t size;
+  size_t requested_size; // Size passed to msgq_new_queue, an existing segment keeps its own
   int reader_id;
   uint64_t read_uid_local;
   uint64_t write_uid_local;
 
   bool read_conflate;
+  bool borrowed;
+  size_t reserved_size;
+  uint64_t num_overruns; // Times this reader was reset because the publisher overwrote unread data
   std::string endpoint;
 };
 
@@ -57,12 +95,23 @@ int msgq_msg_close(msgq_msg_t *msg);
 
 int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
 void msgq_close_queue(msgq_queue_t *q);
-void msgq_init_publisher(msgq_queue_t * q);
+void msgq_init_publisher(msgq_queue_t * q, size_t max_readers = DEFAULT_NUM_READERS, bool trace_reads = false);
 void msgq_init_subscriber(msgq_queue_t * q);
 
 int msgq_msg_send(msgq_msg_t *msg, msgq_queue_t *q);
+
+// In-place send. msgq_msg_reserve returns room for size bytes in the segment,
+// msgq_msg_commit publishes the first size bytes of it to the readers.
+char * msgq_msg_reserve(msgq_queue_t *q, size_t size);
+int msgq_msg_commit(msgq_queue_t *q, size_t size);
 int msgq_msg_recv(msgq_msg_t *msg, msgq_queue_t *q);
 int msgq_msg_ready(msgq_queue_t * q);
+
+// Zero-copy receive. msg->data points into the shared memory segment and must not be closed.
+// The data stays valid until a receive on this queue returns a new message, as long as msgq_msg_borrow_valid returns true.
+int msgq_msg_borrow(msgq_msg_t *msg, msgq_queue_t *q);
+bool msgq_msg_borrow_valid(msgq_queue_t *q);
+bool msgq_msg_release(msgq_queue_t *q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
 
 bool msgq_all_readers_updated(msgq_queue_t *q);
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <time.h>
+#include <unistd.h>
+
+#include "impl_msgq.h"
+#include "impl_zmq.h"
+
+// Publishes timestamped messages to a number of subscribers and reports throughput,
+// publish to receive latency and CPU time per message. Runs headless, no services needed.
+//
+// usage: msgq_bench [--backend msgq|zmq|all] [--sizes 16,4096,...] [--readers 1,4]
+//                   [--conflate 0,1] [--mode poll,block] [--duration s] [--rate hz] [--bandwidth MB/s]
+
+struct BenchConfig {
+  bool zmq;
+  size_t size;
+  int readers;
+  bool conflate;
+  bool poll;
+};
+
+struct ReaderResult {
+  std::vector<uint64_t> latencies;
+  uint64_t cpu_ns = 0;
+};
+
+static uint64_t nanos_monotonic() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static uint64_t nanos_thread_cpu() {
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+template <typename T>
+static std::vector<T> parse_list(const char *arg) {
+  std::vector<T> r;
+  std::string s(arg);
+  size_t pos = 0;
+  while (pos <= s.size()) {
+    size_t end = s.find(',', pos);
+    if (end == std::string::npos) end = s.size();
+    std::string item = s.substr(pos, end - pos);
+    if constexpr (std::is_same<T, std::string>::value) {
+      r.push_back(item);
+    } else {
+      r.push_back((T)strtoull(item.c_str(), NULL, 10));
+    }
+    pos = end + 1;
+  }
+  return r;
+}
+
+static double percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t idx = std::min(sorted.size() - 1, (size_t)(p / 100.0 * sorted.size()));
+  return sorted[idx] / 1e3;
+}
+
+static void run_reader(SubSocket *sock, const BenchConfig &cfg, std::atomic<bool> &done, ReaderResult &result) {
+  Poller *poller = nullptr;
+  if (cfg.poll) {
+    poller = cfg.zmq ? (Poller *)new ZMQPoller() : (Poller *)new MSGQPoller();
+    poller->registerSocket(sock);
+  } else {
+    sock->setTimeout(100);
+  }
+
+  uint64_t cpu_start = nanos_thread_cpu();
+  uint64_t last_rcv = nanos_monotonic();
+  while (true) {
+    Message *msg = nullptr;
+    if (cfg.poll) {
+      if (!poller->poll(100).empty()) {
+        msg = sock->receive(true);
+      }
+    } else {
+      msg = sock->receive();
+    }
+
+    uint64_t t = nanos_monotonic();
+    if (msg != nullptr) {
+      uint64_t sent;
+      memcpy(&sent, msg->getData(), sizeof(sent));
+      result.latencies.push_back(t - sent);
+      delete msg;
+      last_rcv = t;
+    } else if (done && t - last_rcv > 200 * 1000 * 1000ULL) {
+      break;
+    }
+  }
+  result.cpu_ns = nanos_thread_cpu() - cpu_start;
+
+  delete poller;
+}
+
+static void run_bench(const BenchConfig &cfg, int idx, double duration, double rate, double bandwidth) {
+  // Each run gets its own queue, sized to fit the largest messages
+  std::string endpoint = cfg.zmq ? std::to_string(9200 + idx % 500) : "msgq_bench_" + std::to_string(getpid()) + "_" + std::to_string(idx);
+  size_t segment_size = std::max((size_t)DEFAULT_SEGMENT_SIZE, 8 * cfg.size);
+  setenv("MSGQ_SEGMENT_SIZE", std::to_string(segment_size).c_str(), 1);
+
+  Context *ctx = cfg.zmq ? (Context *)new ZMQContext() : (Context *)new MSGQContext();
+  PubSocket *pub = cfg.zmq ? (PubSocket *)new ZMQPubSocket() : (PubSocket *)new MSGQPubSocket();
+  int r = pub->connect(ctx, endpoint, false);
+  assert(r == 0);
+
+  std::vector<SubSocket *> subs;
+  for (int i = 0; i < cfg.readers; i++) {
+    SubSocket *sub = cfg.zmq ? (SubSocket *)new ZMQSubSocket() : (SubSocket *)new MSGQSubSocket();
+    r = sub->connect(ctx, endpoint, "127.0.0.1", cfg.conflate, false);
+    assert(r == 0);
+    subs.push_back(sub);
+  }
+
+  std::atomic<bool> done(false);
+  std::vector<ReaderResult> results(cfg.readers);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < cfg.readers; i++) {
+    threads.emplace_back(run_reader, subs[i], std::cref(cfg), std::ref(done), std::ref(results[i]));
+  }
+
+  // Give ZMQ subscribers time to connect
+  usleep(200 * 1000);
+
+  double msg_rate = rate;
+  if (bandwidth > 0) msg_rate = std::min(msg_rate, bandwidth * 1e6 / cfg.size);
+  uint64_t interval = msg_rate > 0 ? (uint64_t)(1e9 / msg_rate) : 0;
+
+  std::vector<char> buf(cfg.size, 0x5a);
+  uint64_t sent = 0;
+  uint64_t cpu_start = nanos_thread_cpu();
+  uint64_t start = nanos_monotonic();
+  uint64_t end = start + (uint64_t)(duration * 1e9);
+  uint64_t next = start;
+  while (true) {
+    uint64_t t = nanos_monotonic();
+    if (t >= end) break;
+    if (interval > 0 && t < next) {
+      // Sleep instead of spinning, that would count as publisher CPU time
+      struct timespec ts = {.tv_sec = (time_t)(next / 1000000000ULL), .tv_nsec = (long)(next % 1000000000ULL)};
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      t = nanos_monotonic();
+    }
+    next += interval;
+
+    memcpy(buf.data(), &t, sizeof(t));
+    memcpy(buf.data() + sizeof(t), &sent, sizeof(sent));
+    pub->send(buf.data(), buf.size());
+    sent++;
+  }
+  uint64_t elapsed = nanos_monotonic() - start;
+  uint64_t pub_cpu = nanos_thread_cpu() - cpu_start;
+
+  done = true;
+  for (auto &t : threads) t.join();
+
+  std::vector<uint64_t> latencies;
+  uint64_t sub_cpu = 0;
+  for (auto &r : results) {
+    latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+    sub_cpu += r.cpu_ns;
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  double recv_per_reader = (double)latencies.size() / cfg.readers;
+  printf("%-5s %8zu %7d %8s %5s %9lu %7.1f%% %10.2f %9.1f %9.1f %9.1f %9.2f %9.2f\n",
+         cfg.zmq ? "zmq" : "msgq", cfg.size, cfg.readers, cfg.conflate ? "yes" : "no", cfg.poll ? "poll" : "block",
+         (unsigned long)sent, sent > 0 ? 100.0 * recv_per_reader / sent : 0.0,
+         recv_per_reader * cfg.size / (elapsed / 1e9) / 1e6,
+         percentile(latencies, 50), percentile(latencies, 99), percentile(latencies, 99.9),
+         sent > 0 ? pub_cpu / 1e3 / sent : 0.0, latencies.size() > 0 ? sub_cpu / 1e3 / latencies.size() : 0.0);
+  fflush(stdout);
+
+  for (auto s : subs) delete s;
+  delete pub;
+  delete ctx;
+
+  if (!cfg.zmq) {
+    unlink(("/dev/shm/" + endpoint).c_str());
+  }
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> backends = {"msgq", "zmq"};
+  std::vector<size_t> sizes = {16, 256, 4096, 65536, 1024 * 1024, 4 * 1024 * 1024};
+  std::vector<int> readers = {1, 4};
+  std::vector<int> conflates = {0, 1};
+  std::vector<std::string> modes = {"poll", "block"};
+  double duration = 1.0, rate = 1000, bandwidth = 1000;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--backend") {
+      std::string b = argv[i + 1];
+      if (b != "all") backends = {b};
+    } else if (arg == "--sizes") {
+      sizes = parse_list<size_t>(argv[i + 1]);
+    } else if (arg == "--readers") {
+      readers = parse_list<int>(argv[i + 1]);
+    } else if (arg == "--conflate") {
+      conflates = parse_list<int>(argv[i + 1]);
+    } else if (arg == "--mode") {
+      modes = parse_list<std::string>(argv[i + 1]);
+    } else if (arg == "--duration") {
+      duration = atof(argv[i + 1]);
+    } else if (arg == "--rate") {
+      rate = atof(argv[i + 1]);  // 0 publishes as fast as possible
+    } else if (arg == "--bandwidth") {
+      bandwidth = atof(argv[i + 1]);  // caps the rate for large messages, 0 disables
+    } else {
+      fprintf(stderr, "unknown argument %s\n", arg.c_str());
+      return 1;
+    }
+  }
+
+  printf("%-5s %8s %7s %8s %5s %9s %8s %10s %9s %9s %9s %9s %9s\n", "impl", "size", "readers", "conflate", "mode",
+         "sent", "recv", "MB/s", "p50 us", "p99 us", "p99.9 us", "pub us", "sub us");
+
+  int idx = 0;
+  for (auto &backend : backends) {
+    for (auto size : sizes) {
+      for (auto r : readers) {
+        for (auto conflate : conflates) {
+          for (auto &mode : modes) {
+            BenchConfig cfg = {.zmq = backend == "zmq", .size = std::max(size, (size_t)16), .readers = r,
+                               .conflate = conflate != 0, .poll = mode == "poll"};
+            run_bench(cfg, idx++, duration, rate, bandwidth);
+          }
+        }
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,94 @@
+#include <cstdio>
+#include <cstdlib>
+#include <set>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "msgq.h"
+#include "services.h"
+
+// Prints the counters kept in every msgq segment header: the high-water mark for tuning
+// the sizes in services.py, and invalidations/resets per reader for finding slow consumers.
+//
+// usage: msgq_stats [--interval s] [--readers] [service ...]
+
+static void print_reader(const msgq_header_t *header, size_t size, int i) {
+  uint32_t write_cycles, write_pointer, read_cycles, read_pointer;
+  UNPACK64(write_cycles, write_pointer, header->write_pointer);
+  UNPACK64(read_cycles, read_pointer, header->read_pointers[i]);
+  uint64_t lag = (read_cycles == write_cycles) ? write_pointer - read_pointer : size - read_pointer + write_pointer;
+
+  // The lower half of the uid is the thread id of the reader
+  printf("  reader %2d  tid %8lu  lag %12lu  overruns %8lu%s\n", i, (unsigned long)(header->read_uids[i] & 0xFFFFFFFF),
+         (unsigned long)lag, (unsigned long)header->read_overruns[i], header->read_valids[i] ? "" : "  (invalid)");
+}
+
+static void print_stats(const std::set<std::string> &filter, bool readers) {
+  printf("%-24s %10s %10s %7s %7s %10s %10s %6s %8s %8s %6s\n", "service", "segment", "max lag", "usage", "readers",
+         "msgs", "MB", "wraps", "invalid", "resets", "evict");
+
+  for (const auto& it : services) {
+    if (!filter.empty() && filter.count(it.name) == 0) continue;
+
+    std::string path = std::string("/dev/shm/") + it.name;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) continue;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(msgq_header_t)) {
+      close(fd);
+      continue;
+    }
+
+    void *mem = mmap(NULL, sizeof(msgq_header_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) continue;
+
+    const msgq_header_t *header = (const msgq_header_t *)mem;
+    const msgq_stats_t &stats = header->stats;
+    size_t size = st.st_size - sizeof(msgq_header_t);
+    printf("%-24s %10zu %10lu %6.1f%% %7d %10lu %10.1f %6lu %8lu %8lu %6lu\n", it.name, size,
+           (unsigned long)header->max_lag, 100.0 * header->max_lag / size, __builtin_popcountll(header->reader_mask),
+           (unsigned long)stats.msgs_sent, stats.bytes_sent / 1e6, (unsigned long)stats.wraparounds,
+           (unsigned long)stats.invalidations, (unsigned long)stats.resets, (unsigned long)stats.evictions);
+
+    if (readers) {
+      for (uint64_t mask = header->reader_mask; mask != 0; mask &= mask - 1) {
+        print_reader(header, size, __builtin_ctzll(mask));
+      }
+    }
+
+    munmap(mem, sizeof(msgq_header_t));
+  }
+}
+
+int main(int argc, char** argv) {
+  double interval = 0;
+  bool readers = false;
+  std::set<std::string> filter;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--interval" && i + 1 < argc) {
+      interval = atof(argv[++i]);
+    } else if (arg == "--readers") {
+      readers = true;
+    } else {
+      filter.insert(arg);
+    }
+  }
+
+  while (true) {
+    print_stats(filter, readers);
+    if (interval <= 0) break;
+
+    printf("\n");
+    fflush(stdout);
+    usleep(interval * 1e6);
+  }
+
+  return 0;
+}
@@ -2,6 +2,8 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string>
+#include <algorithm>
+#include <deque>
 #include <mutex>
 
 #include "services.h"
@@ -44,25 +46,49 @@ private:
 
 MessageContext message_context;
 
+static capnp::ReaderOptions reader_options() {
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = kj::maxValue; // Don't limit
+  return options;
+}
+
+// A copied message with its reader, used for lossless services
+struct QueuedMessage {
+  QueuedMessage(Message *msg)
+      : msg(msg), reader(kj::ArrayPtr<const capnp::word>((const capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word)), reader_options()) {
+    assert((uintptr_t)msg->getData() % sizeof(capnp::word) == 0);
+  }
+  ~QueuedMessage() { delete msg; }
+  Message *msg;
+  capnp::FlatArrayMessageReader reader;
+};
+
 struct SubMaster::SubMessage {
   std::string name;
   SubSocket *socket = nullptr;
   int freq = 0;
-  bool updated = false, alive = false, valid = true, ignore_alive;
+  bool updated = false, alive = false, valid = true, ignore_alive, lossless, borrowed;
   uint64_t rcv_time = 0, rcv_frame = 0;
   void *allocated_msg_reader = nullptr;
   capnp::FlatArrayMessageReader *msg_reader = nullptr;
+  Message *msg = nullptr;
   AlignedBuffer aligned_buf;
   cereal::Event::Reader event;
+  std::vector<cereal::Event::Reader> batch;
+  std::deque<QueuedMessage> queue;
+  size_t queue_size = 0;
+  uint64_t dropped = 0;
 };
 
 SubMaster::SubMaster(const std::vector<const char *> &service_list, const char *address,
-                     const std::vector<const char *> &ignore_alive) {
+                     const std::vector<const char *> &ignore_alive, const std::vector<const char *> &lossless,
+                     const std::vector<const char *> &borrowed) {
   poller_ = Poller::create();
   for (auto name : service_list) {
     const service *serv = get_service(name);
     assert(serv != nullptr);
-    SubSocket *socket = SubSocket::create(message_context.context(), name, address ? address : "127.0.0.1", true);
+    bool conflate = !inList(lossless, name);
+    SubSocket *socket = SubSocket::create(message_context.context(), name, address ? address : "127.0.0.1", conflate);
     assert(socket != 0);
     poller_->registerSocket(socket);
     SubMessage *m = new SubMessage{
@@ -70,7 +96,10 @@ SubMaster::SubMaster(const std::vector<const char *> &service_list, const char *
       .socket = socket,
       .freq = serv->frequency,
       .ignore_alive = inList(ignore_alive, name),
-      .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader))};
+      .lossless = !conflate,
+      .borrowed = conflate && inList(borrowed, name),
+      .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader)),
+      .queue_size = (size_t)std::max(serv->frequency, 10)};
     m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader({});
     messages_[socket] = m;
     services_[name] = m;
@@ -86,25 +115,76 @@ void SubMaster::update(int timeout) {
   std::vector<std::pair<std::string, cereal::Event::Reader>> messages;
 
   for (auto s : sockets) {
-    Message *msg = s->receive(true);
-    if (msg == nullptr) continue;
-
     SubMessage *m = messages_.at(s);
 
+    // Drain the socket, keeping the most recent messages if the consumer fell behind
+    if (m->lossless) {
+      size_t received = 0;
+      while (Message *msg = s->receive(true)) {
+        // The last message of the previous update is kept alive until replaced
+        if (received++ == 0) m->queue.clear();
+
+        if (m->queue.size() == m->queue_size) {
+          m->queue.pop_front();
+          m->dropped++;
+        }
+        m->queue.emplace_back(msg);
+      }
+
+      if (received > 0) {
+        for (auto &q : m->queue) {
+          messages.push_back({m->name, q.reader.getRoot<cereal::Event>()});
+        }
+      }
+      continue;
+    }
+
+    if (!m->borrowed) {
+      Message *msg = s->receive(true);
+      if (msg == nullptr) continue;
+
+      m->msg_reader->~FlatArrayMessageReader();
+      m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(m->aligned_buf.align(msg), reader_options());
+      delete msg;
+      messages.push_back({m->name, m->msg_reader->getRoot<cereal::Event>()});
+      continue;
+    }
+
+    // Read the event in place, the message data stays alive until the next message is received on this socket
+    Message *msg = s->receiveBorrowed(true);
+    if (msg == nullptr) continue;
+
     m->msg_reader->~FlatArrayMessageReader();
-    capnp::ReaderOptions options;
-    options.traversalLimitInWords = kj::maxValue; // Don't limit
-    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(m->aligned_buf.align(msg), options);
-    delete msg;
+    delete m->msg;
+    m->msg = msg;
+
+    kj::ArrayPtr<const capnp::word> words;
+    if ((uintptr_t)msg->getData() % sizeof(capnp::word) == 0) {
+      words = kj::ArrayPtr<const capnp::word>((const capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word));
+    } else {
+      words = m->aligned_buf.align(msg);
+    }
+
+    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(words, reader_options());
     messages.push_back({m->name, m->msg_reader->getRoot<cereal::Event>()});
   }
 
   update_msgs(current_time, messages);
+
+  // Messages that were kept since an earlier update can be overwritten by a fast publisher
+  for (auto &kv : messages_) {
+    SubMessage *m = kv.second;
+    if (!m->updated && m->msg != nullptr && !m->socket->borrowValid()) {
+      m->valid = false;
+    }
+  }
 }
 
 void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<std::string, cereal::Event::Reader>> &messages){
   if (++frame == UINT64_MAX) frame = 1;
 
+  for (auto &kv : messages_) kv.second->batch.clear();
+
   for(auto &kv : messages) {
     auto m_find = services_.find(kv.first);
     if (m_find == services_.end()){
@@ -112,6 +192,7 @@ void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<s
     }
     SubMessage *m = m_find->second;
     m->event = kv.second;
+    m->batch.push_back(kv.second);
     m->updated = true;
     m->rcv_time = current_time;
     m->rcv_frame = frame;
@@ -171,21 +252,120 @@ uint64_t SubMaster::rcv_time(const char *name) const {
   return services_.at(name)->rcv_time;
 }
 
+bool SubMaster::intact(const char *name) const {
+  SubMessage *m = services_.at(name);
+  return m->msg == nullptr || m->socket->borrowValid();
+}
+
 cereal::Event::Reader &SubMaster::operator[](const char *name) const {
   return services_.at(name)->event;
 };
 
+const std::vector<cereal::Event::Reader> &SubMaster::batch(const char *name) const {
+  return services_.at(name)->batch;
+}
+
+uint64_t SubMaster::dropped(const char *name) const {
+  return services_.at(name)->dropped;
+}
+
+uint64_t SubMaster::overruns(const char *name) const {
+  return services_.at(name)->socket->getOverruns();
+}
+
 SubMaster::~SubMaster() {
   delete poller_;
   for (auto &kv : messages_) {
     SubMessage *m = kv.second;
     m->msg_reader->~FlatArrayMessageReader();
     free(m->allocated_msg_reader);
+    delete m->msg;
     delete m->socket;
     delete m;
   }
 }
 
+MessageMerger::MessageMerger(const std::vector<const char *> &service_list, uint64_t reorder_window_ns,
+                             const char *address, const std::vector<const char *> &ignore_alive)
+    : sm_(service_list, address, ignore_alive, service_list), reorder_window_(reorder_window_ns) {
+  for (auto name : service_list) {
+    services_.push_back(sm_.services_.at(name));
+  }
+  queues_.resize(services_.size());
+
+  allocated_msg_reader_ = malloc(sizeof(capnp::FlatArrayMessageReader));
+  msg_reader_ = new (allocated_msg_reader_) capnp::FlatArrayMessageReader({});
+}
+
+static inline kj::ArrayPtr<const capnp::word> message_words(Message *msg) {
+  assert((uintptr_t)msg->getData() % sizeof(capnp::word) == 0);
+  return kj::ArrayPtr<const capnp::word>((const capnp::word *)msg->getData(), msg->getSize() / sizeof(capnp::word));
+}
+
+void MessageMerger::update(int timeout) {
+  sm_.update(timeout);
+
+  // Take over the messages the SubMaster queued, its events for them are not used
+  for (size_t i = 0; i < services_.size(); i++) {
+    SubMaster::SubMessage *m = services_[i];
+    if (!m->updated) continue;
+
+    for (auto &q : m->queue) {
+      uint64_t mono_time = q.reader.getRoot<cereal::Event>().getLogMonoTime();
+
+      // Each publisher is in order by itself, only the head of its queue needs to be in the heap
+      if (queues_[i].empty()) {
+        heads_.push({mono_time, i});
+      }
+      queues_[i].push_back({mono_time, q.msg});
+      q.msg = nullptr;
+      num_pending_++;
+      newest_ = std::max(newest_, mono_time);
+    }
+    m->queue.clear();
+    m->batch.clear();
+  }
+}
+
+bool MessageMerger::next(cereal::Event::Reader &event, uint64_t flush_until) {
+  if (heads_.empty()) return false;
+
+  Head head = heads_.top();
+  if (head.mono_time > flush_until && head.mono_time + reorder_window_ > newest_) return false;
+
+  heads_.pop();
+  auto &queue = queues_[head.idx];
+  Entry entry = queue.front();
+  queue.pop_front();
+  num_pending_--;
+  if (!queue.empty()) {
+    heads_.push({queue.front().mono_time, head.idx});
+  }
+
+  msg_reader_->~FlatArrayMessageReader();
+  delete current_msg_;
+  current_msg_ = entry.msg;
+  msg_reader_ = new (allocated_msg_reader_) capnp::FlatArrayMessageReader(message_words(current_msg_), reader_options());
+  event = msg_reader_->getRoot<cereal::Event>();
+  return true;
+}
+
+uint64_t MessageMerger::newest(const char *name) const {
+  auto it = std::find(services_.begin(), services_.end(), sm_.services_.at(name));
+  assert(it != services_.end());
+  const auto &queue = queues_[it - services_.begin()];
+  return queue.empty() ? 0 : queue.back().mono_time;
+}
+
+MessageMerger::~MessageMerger() {
+  msg_reader_->~FlatArrayMessageReader();
+  free(allocated_msg_reader_);
+  delete current_msg_;
+  for (auto &queue : queues_) {
+    for (auto &entry : queue) delete entry.msg;
+  }
+}
+
 PubMaster::PubMaster(const std::vector<const char *> &service_list) {
   for (auto name : service_list) {
     assert(get_service(name) != nullptr);
@@ -196,8 +376,14 @@ PubMaster::PubMaster(const std::vector<const char *> &service_list) {
 }
 
 int PubMaster::send(const char *name, MessageBuilder &msg) {
-  auto bytes = msg.toBytes();
-  return send(name, bytes.begin(), bytes.size());
+  // Serialize straight into the socket's buffer
+  PubSocket *socket = sockets_.at(name);
+  size_t size = msg.getSerializedSize();
+  char *buf = socket->reserve(size);
+  if (buf == nullptr) return -1;
+
+  msg.serializeTo(kj::arrayPtr((capnp::byte *)buf, size));
+  return socket->commit(size);
 }
 
 PubMaster::~PubMaster() {
@@ -6,18 +6,39 @@ TICI = os.path.isfile('/TICI')
 RESERVED_PORT = 8022  # sshd
 STARTING_PORT = 8001
 
+# msgq segments hold this many seconds of messages, within these bounds
+SEGMENT_HISTORY = 10.
+MIN_SEGMENT_SIZE = 2 * 1024 * 1024
+MAX_SEGMENT_SIZE = 100 * 1024 * 1024
+DEFAULT_MESSAGE_SIZE = 4 * 1024
+
+# msgq reader slots per queue, see DEFAULT_NUM_READERS and MAX_READERS in msgq.h
+DEFAULT_NUM_READERS = 32
+MAX_READERS = 64
+
 
 def new_port(port: int):
   port += STARTING_PORT
   return port + 1 if port >= RESERVED_PORT else port
 
 
+def segment_size(frequency: float, message_size: int) -> int:
+  size = int(frequency * message_size * SEGMENT_HISTORY)
+  size = min(max(size, MIN_SEGMENT_SIZE), MAX_SEGMENT_SIZE)
+  return -(-size // MIN_SEGMENT_SIZE) * MIN_SEGMENT_SIZE
+
+
 class Service:
-  def __init__(self, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None):
+  def __init__(self, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None,
+               message_size: int = DEFAULT_MESSAGE_SIZE, num_readers: int = DEFAULT_NUM_READERS, trace_reads: bool = False):
+    assert 0 < num_readers <= MAX_READERS
     self.port = port
     self.should_log = should_log
     self.frequency = frequency
     self.decimation = decimation
+    self.segment_size = segment_size(frequency, message_size)
+    self.num_readers = num_readers
+    self.trace_reads = trace_reads
 
 DCAM_FREQ = 10. if not TICI else 20.
 
@@ -65,9 +86,39 @@ services = {
 
   # debug
   "testJoystick": (False, 0.),
+
+  # appended, the ports come from the order of this dict
+  "canLatency": (True, 1., 1),
 }
-service_list = {name: Service(new_port(idx), *vals) for  # type: ignore
-                idx, (name, vals) in enumerate(services.items())}
+# typical serialized size in bytes, used to size the msgq segments
+message_sizes = {
+  "sensorEvents": 2 * 1024,
+  "can": 8 * 1024,
+  "sendcan": 1024,
+  "procLog": 64 * 1024,
+  "thumbnail": 64 * 1024,
+  "roadCameraState": 512 * 1024,
+  "driverCameraState": 512 * 1024,
+  "wideRoadCameraState": 512 * 1024,
+  "modelV2": 48 * 1024,
+  "driverState": 8 * 1024,
+}
+
+# reader slots, for the services most processes and tools subscribe to, or the busy ones with few readers
+num_readers = {
+  "carState": MAX_READERS,
+  "controlsState": MAX_READERS,
+  "deviceState": MAX_READERS,
+  "can": 16,
+  "sendcan": 16,
+}
+
+# readers stamp the time they first got a message in the msgq header, boardd traces the can latency with it
+trace_reads = {"can"}
+
+service_list = {name: Service(new_port(idx), *vals, message_size=message_sizes.get(name, DEFAULT_MESSAGE_SIZE),  # type: ignore
+                              num_readers=num_readers.get(name, DEFAULT_NUM_READERS), trace_reads=name in trace_reads)
+                for idx, (name, vals) in enumerate(services.items())}
 
 
 def build_header():
@@ -75,13 +126,15 @@ def build_header():
   h += "/* THIS IS AN AUTOGENERATED FILE, PLEASE EDIT services.py */\n"
   h += "#ifndef __SERVICES_H\n"
   h += "#define __SERVICES_H\n"
-  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; };\n"
+  h += "#include <stddef.h>\n"
+  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; size_t segment_size; size_t num_readers; bool trace_reads; };\n"
   h += "static struct service services[] = {\n"
   for k, v in service_list.items():
     should_log = "true" if v.should_log else "false"
     decimation = -1 if v.decimation is None else v.decimation
-    h += '  { "%s", %d, %s, %d, %d },\n' % \
-         (k, v.port, should_log, v.frequency, decimation)
+    trace_reads = "true" if v.trace_reads else "false"
+    h += '  { "%s", %d, %s, %d, %d, %d, %d, %s },\n' % \
+         (k, v.port, should_log, v.frequency, decimation, v.segment_size, v.num_readers, trace_reads)
   h += "};\n"
   h += "#endif\n"
   return h
@@ -0,0 +1,33 @@
+from common.realtime import sec_since_boot
+
+# Latencies in the log2 buckets of cereal's LatencyHistogram, bucket i counts the ones of
+# [2^i, 2^(i+1)) us. Keep in sync with selfdrive/common/latency_histogram.h.
+BUCKETS = 20
+
+
+class LatencyHistogram():
+  def __init__(self):
+    self.reset()
+
+  def reset(self):
+    self.count = 0
+    self.sum_us = 0
+    self.max_us = 0
+    self.buckets = [0] * BUCKETS
+
+  def add(self, latency_ns):
+    us = max(int(latency_ns) // 1000, 0)
+    self.buckets[min(max(us.bit_length() - 1, 0), BUCKETS - 1)] += 1
+    self.count += 1
+    self.sum_us += us
+    self.max_us = max(self.max_us, us)
+
+  def add_since(self, mono_time):
+    """Adds the latency from mono_time, a logMonoTime, to now"""
+    self.add(int(sec_since_boot() * 1e9) - mono_time)
+
+  def write(self, h):
+    h.count = self.count
+    h.sumUs = self.sum_us
+    h.maxUs = self.max_us
+    h.buckets = self.buckets
@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+#include "common.h"
+#include "can_log.h"
+
+// Decode and pack throughput of CANParser/CANPacker, offline: runs over the can events of a
+// recorded rlog, or over synthetic events packed for a set of DBCs. Reports ns per frame and
+// signal, heap allocations per step, and fails when a result regresses against a baseline.
+//
+// usage: can_bench [--dbc name,...] [--rlog rlog] [--bus n] [--steps n] [--iterations n]
+//                  [--baseline file] [--write-baseline file] [--tolerance fraction]
+
+static const char *DEFAULT_DBCS = "honda_civic_touring_2016_can_generated,toyota_rav4_2017_pt_generated,"
+                                  "hyundai_kia_generic,vw_mqb_2010";
+
+#define REPEATS 5
+
+uint64_t ReverseBytes(uint64_t x);
+
+static uint64_t num_allocs = 0;
+
+void *operator new(size_t size) {
+  num_allocs++;
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+struct BenchResult {
+  double ns_per_frame = 0;
+  double ns_per_signal = 0;
+  double allocs_per_step = 0;
+  double pack_ns_per_msg = 0;
+  double pack_allocs_per_msg = 0;
+};
+
+static uint64_t nanos_monotonic() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Fastest of a few runs, the least disturbed by the rest of the machine
+template <typename F>
+static uint64_t best_of(int repeats, F f) {
+  uint64_t best = UINT64_MAX;
+  for (int i = 0; i < repeats; i++) {
+    uint64_t start = nanos_monotonic();
+    f();
+    best = std::min(best, nanos_monotonic() - start);
+  }
+  return best;
+}
+
+static std::vector<std::string> split(const std::string &s) {
+  std::vector<std::string> r;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) r.push_back(item);
+  }
+  return r;
+}
+
+// Only the counters of the types the packer knows are set, the others are plain signals
+static bool packer_counter(CANPacker &packer, uint32_t address) {
+  const PackPlan *plan = packer.lookup_plan(address);
+  return plan->counter_sig >= 0 && plan->sigs[plan->counter_sig].type != SignalType::DEFAULT;
+}
+
+// Random values for every signal of a message, counter and checksum are left to the packer
+static std::vector<SignalPackIndexValue> random_values(const Msg &msg, std::mt19937 &rng) {
+  std::vector<SignalPackIndexValue> values;
+  for (int j = 0; j < msg.num_sigs; j++) {
+    const Signal &sig = msg.sigs[j];
+    if (sig.type != SignalType::DEFAULT) continue;
+    uint64_t raw = rng() & ((1ULL << std::min(sig.b2, 16)) - 1);
+    values.push_back({j, raw * sig.factor + sig.offset});
+  }
+  return values;
+}
+
+// One event per step with every message of the DBC on the bus, and every other one on a second bus
+static std::vector<std::string> synthetic_events(const DBC *dbc, CANPacker &packer, int bus, int steps) {
+  std::mt19937 rng(42);
+  std::vector<std::string> events;
+  std::map<uint32_t, int> counters;
+  for (int step = 0; step < steps; step++) {
+    std::vector<std::pair<int, std::pair<uint32_t, uint64_t>>> frames;
+    for (int i = 0; i < dbc->num_msgs; i++) {
+      const Msg &msg = dbc->msgs[i];
+      // The packer doesn't compute the pedal checksum
+      if (msg.size > 8 || msg.address == 0x200 || msg.address == 0x201) continue;
+
+      int counter = packer_counter(packer, msg.address) ? counters[msg.address]++ : -1;
+      uint64_t dat = ReverseBytes(packer.pack(msg.address, random_values(msg, rng), counter));
+      frames.push_back({bus, {msg.address, dat}});
+      if (i % 2 == 0) frames.push_back({bus + 1, {msg.address, dat}});
+    }
+    std::shuffle(frames.begin(), frames.end(), rng);
+
+    // One segment like the events boardd builds, so reading them doesn't allocate
+    capnp::MallocMessageBuilder msg(64 + 8 * frames.size());
+    auto event = msg.initRoot<cereal::Event>();
+    event.setLogMonoTime(step * 10000000ULL);
+    auto cans = event.initCan(frames.size());
+    for (size_t i = 0; i < frames.size(); i++) {
+      uint32_t address = frames[i].second.first;
+      cans[i].setAddress(address);
+      cans[i].setBusTime(step);
+      cans[i].setDat(kj::arrayPtr((const uint8_t *)&frames[i].second.second, packer.lookup_message(address)->size));
+      cans[i].setSrc(frames[i].first);
+    }
+    auto bytes = capnp::messageToFlatArray(msg);
+    events.emplace_back((const char *)bytes.begin(), bytes.size() * sizeof(capnp::word));
+  }
+  return events;
+}
+
+// Frames and signals the parser decodes in one pass over the events
+static void count_frames(const std::vector<std::string> &events, const DBC *dbc, int bus, uint64_t &frames, uint64_t &signals) {
+  std::map<uint32_t, size_t> num_sigs;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    num_sigs[dbc->msgs[i].address] = dbc->msgs[i].num_sigs;
+  }
+
+  frames = signals = 0;
+  for (const auto &data : events) {
+    kj::ArrayPtr<const capnp::word> words((const capnp::word *)data.data(), data.size() / sizeof(capnp::word));
+    capnp::FlatArrayMessageReader reader(words);
+    for (auto c : reader.getRoot<cereal::Event>().getCan()) {
+      auto it = num_sigs.find(c.getAddress());
+      if (c.getSrc() != bus || it == num_sigs.end()) continue;
+      frames++;
+      signals += it->second;
+    }
+  }
+}
+
+static BenchResult run_bench(const std::string &dbc_name, const std::vector<std::string> &log_events, int bus, int steps, int iterations) {
+  BenchResult result;
+  const DBC *dbc = dbc_lookup(dbc_name);
+  CANPacker packer(dbc_name);
+  std::vector<std::string> events = log_events.empty() ? synthetic_events(dbc, packer, bus, steps) : log_events;
+
+  uint64_t frames, signals;
+  count_frames(events, dbc, bus, frames, signals);
+
+  // Decode, the same calls as CANParser.update_strings in Python
+  CANParser parser(bus, dbc_name, false, false);
+  for (const auto &e : events) parser.update_string(e, false); // warm up
+
+  uint64_t allocs_start = num_allocs;
+  uint64_t elapsed = best_of(REPEATS, [&]() {
+    for (int it = 0; it < iterations; it++) {
+      for (const auto &e : events) {
+        parser.update_string(e, false);
+        parser.query_latest();
+      }
+    }
+  });
+  uint64_t num_steps = (uint64_t)REPEATS * iterations * events.size();
+  result.ns_per_frame = frames > 0 ? (double)elapsed / (frames * iterations) : 0;
+  result.ns_per_signal = signals > 0 ? (double)elapsed / (signals * iterations) : 0;
+  result.allocs_per_step = (double)(num_allocs - allocs_start) / num_steps;
+
+  // Pack every message with all its signals, as a car controller step would
+  std::mt19937 rng(0);
+  std::vector<CanPackRequest> requests;
+  for (int i = 0; i < dbc->num_msgs; i++) {
+    const Msg &msg = dbc->msgs[i];
+    if (msg.size > 8) continue;
+    int counter = packer_counter(packer, msg.address) ? 0 : -1;
+    requests.push_back({msg.address, (uint8_t)bus, random_values(msg, rng), counter});
+  }
+
+  const int pack_steps = iterations * 100;
+  uint64_t checksum = 0;
+  allocs_start = num_allocs;
+  elapsed = best_of(REPEATS, [&]() {
+    for (int it = 0; it < pack_steps; it++) {
+      for (const auto &req : requests) {
+        checksum += packer.pack(req.address, req.values, req.counter < 0 ? -1 : it & 0x3);
+      }
+    }
+  });
+  uint64_t num_packs = (uint64_t)pack_steps * requests.size();
+  result.pack_ns_per_msg = (double)elapsed / num_packs;
+  result.pack_allocs_per_msg = (double)(num_allocs - allocs_start) / (REPEATS * num_packs);
+  if (checksum == 1) printf("\n"); // Keeps the packs from being optimized out
+
+  printf("%-40s %8.1f %10.1f %10.2f %10.2f %10.1f %12.2f\n", dbc_name.c_str(), (double)frames / events.size(),
+         result.ns_per_frame, result.ns_per_signal, result.allocs_per_step, result.pack_ns_per_msg, result.pack_allocs_per_msg);
+  fflush(stdout);
+  return result;
+}
+
+static std::map<std::string, BenchResult> read_baseline(const std::string &path) {
+  std::map<std::string, BenchResult> baseline;
+  std::ifstream f(path);
+  std::string line;
+  while (std::getline(f, line)) {
+    if (line.empty() || line[0] == '#') continue;
+
+    // A - instead of a value leaves that metric unchecked
+    std::istringstream ss(line);
+    std::string name, v[5];
+    if (ss >> name >> v[0] >> v[1] >> v[2] >> v[3] >> v[4]) {
+      auto value = [](const std::string &s) { return s == "-" ? NAN : atof(s.c_str()); };
+      baseline[name] = {value(v[0]), value(v[1]), value(v[2]), value(v[3]), value(v[4])};
+    }
+  }
+  return baseline;
+}
+
+static void write_baseline(const std::string &path, const std::map<std::string, BenchResult> &results) {
+  FILE *f = fopen(path.c_str(), "w");
+  if (f == NULL) {
+    fprintf(stderr, "can't write %s\n", path.c_str());
+    return;
+  }
+  fprintf(f, "# dbc ns/frame ns/signal allocs/step pack_ns/msg pack_allocs/msg\n");
+  for (const auto &[name, r] : results) {
+    fprintf(f, "%s %.2f %.3f %.3f %.2f %.3f\n", name.c_str(), r.ns_per_frame, r.ns_per_signal, r.allocs_per_step,
+            r.pack_ns_per_msg, r.pack_allocs_per_msg);
+  }
+  fclose(f);
+}
+
+// Timings may be tolerance slower than the baseline, allocation counts are deterministic.
+// can_bench_baseline.txt only has the allocation counts, the timings depend on the machine.
+static int check_regressions(const std::map<std::string, BenchResult> &results, const std::map<std::string, BenchResult> &baseline, double tolerance) {
+  int failures = 0;
+  auto check = [&](const std::string &name, const char *metric, double value, double base, double limit) {
+    if (!std::isnan(base) && value > limit) {
+      printf("REGRESSION %s %s: %.2f, baseline %.2f\n", name.c_str(), metric, value, base);
+      failures++;
+    }
+  };
+
+  for (const auto &[name, r] : results) {
+    auto it = baseline.find(name);
+    if (it == baseline.end()) {
+      printf("no baseline for %s\n", name.c_str());
+      failures++;
+      continue;
+    }
+
+    const BenchResult &b = it->second;
+    check(name, "ns/frame", r.ns_per_frame, b.ns_per_frame, b.ns_per_frame * (1 + tolerance));
+    check(name, "ns/signal", r.ns_per_signal, b.ns_per_signal, b.ns_per_signal * (1 + tolerance));
+    check(name, "allocs/step", r.allocs_per_step, b.allocs_per_step, b.allocs_per_step + 0.01);
+    check(name, "pack ns/msg", r.pack_ns_per_msg, b.pack_ns_per_msg, b.pack_ns_per_msg * (1 + tolerance));
+    check(name, "pack allocs/msg", r.pack_allocs_per_msg, b.pack_allocs_per_msg, b.pack_allocs_per_msg + 0.01);
+  }
+  return failures;
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> dbcs = split(DEFAULT_DBCS);
+  std::string rlog, baseline_path, write_path;
+  int bus = 0, steps = 500, iterations = 20;
+  double tolerance = 0.25;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--dbc") {
+      dbcs = split(argv[i + 1]);
+    } else if (arg == "--rlog") {
+      rlog = argv[i + 1];
+    } else if (arg == "--bus") {
+      bus = atoi(argv[i + 1]);
+    } else if (arg == "--steps") {
+      steps = atoi(argv[i + 1]);  // synthetic events per DBC
+    } else if (arg == "--iterations") {
+      iterations = atoi(argv[i + 1]);
+    } else if (arg == "--baseline") {
+      baseline_path = argv[i + 1];
+    } else if (arg == "--write-baseline") {
+      write_path = argv[i + 1];
+    } else if (arg == "--tolerance") {
+      tolerance = atof(argv[i + 1]);
+    } else {
+      fprintf(stderr, "unknown argument %s\n", arg.c_str());
+      return 1;
+    }
+  }
+
+  std::vector<std::string> log_events;
+  if (!rlog.empty()) {
+    log_events = read_can_events(rlog);
+    if (log_events.empty()) {
+      fprintf(stderr, "no can events in %s\n", rlog.c_str());
+      return 1;
+    }
+  }
+
+  printf("%-40s %8s %10s %10s %10s %10s %12s\n", "dbc", "frames", "ns/frame", "ns/signal", "allocs", "pack ns", "pack allocs");
+
+  std::map<std::string, BenchResult> results;
+  for (const auto &name : dbcs) {
+    if (dbc_lookup(name) == NULL) {
+      fprintf(stderr, "unknown DBC %s\n", name.c_str());
+      return 1;
+    }
+    results[name] = run_bench(name, log_events, bus, steps, iterations);
+  }
+
+  if (!write_path.empty()) {
+    write_baseline(write_path, results);
+  }
+  if (!baseline_path.empty()) {
+    int failures = check_regressions(results, read_baseline(baseline_path), tolerance);
+    if (failures > 0) return 1;
+  }
+  return 0;
+}
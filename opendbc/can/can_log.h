@@ -0,0 +1,29 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// Reading recorded can data for the offline benchmarks, no car or panda needed.
+
+// The serialized events of an rlog that carry can frames, in log order.
+// Each one can be passed to CANParser::update_string as is.
+inline std::vector<std::string> read_can_events(const std::string &path) {
+  std::vector<std::string> events;
+  kj::Array<capnp::word> buf;
+  if (!read_log(path, buf).empty()) return events;
+
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = kj::maxValue;
+  kj::ArrayPtr<const capnp::word> words = buf.asPtr();
+  while (words.size() > 0) {
+    capnp::FlatArrayMessageReader reader(words, options);
+    const capnp::word *end = reader.getEnd();
+    if (reader.getRoot<cereal::Event>().which() == cereal::Event::CAN) {
+      events.emplace_back((const char *)words.begin(), (end - words.begin()) * sizeof(capnp::word));
+    }
+    words = kj::arrayPtr(end, words.end());
+  }
+  return events;
+}
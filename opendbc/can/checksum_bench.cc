@@ -0,0 +1,95 @@
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+#include "common.h"
+#include "can_log.h"
+
+// Runs every checksum kernel over the frames of a recorded log and reports ns/frame.
+// Without a log it falls back to random frames of all lengths.
+//
+// usage: checksum_bench [rlog] [--iterations n]
+
+struct Frame {
+  uint32_t address;
+  int size;
+  uint64_t dat_le, dat_be;
+};
+
+static uint64_t nanos_monotonic() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static std::vector<Frame> load_frames(const std::string &path) {
+  std::vector<Frame> frames;
+  for (const auto &data : read_can_events(path)) {
+    kj::ArrayPtr<const capnp::word> words((const capnp::word *)data.data(), data.size() / sizeof(capnp::word));
+    capnp::FlatArrayMessageReader reader(words);
+    for (auto c : reader.getRoot<cereal::Event>().getCan()) {
+      auto dat = c.getDat();
+      if (dat.size() == 0 || dat.size() > 8) continue;
+
+      uint8_t padded[8] = {0};
+      memcpy(padded, dat.begin(), dat.size());
+      frames.push_back({c.getAddress(), (int)dat.size(), read_u64_le(padded), read_u64_be(padded)});
+    }
+  }
+  return frames;
+}
+
+static std::vector<Frame> random_frames(size_t n) {
+  std::mt19937_64 rng(0);
+  std::vector<Frame> frames;
+  for (size_t i = 0; i < n; i++) {
+    uint8_t dat[8] = {0};
+    int size = 1 + rng() % 8;
+    for (int j = 0; j < size; j++) dat[j] = rng();
+    frames.push_back({(uint32_t)(rng() % 0x800), size, read_u64_le(dat), read_u64_be(dat)});
+  }
+  return frames;
+}
+
+template <typename F>
+static void run(const char *name, const std::vector<Frame> &frames, int iterations, F checksum) {
+  unsigned int acc = 0; // Keeps the compiler from dropping the calls
+  uint64_t start = nanos_monotonic();
+  for (int i = 0; i < iterations; i++) {
+    for (const auto &f : frames) acc += checksum(f);
+  }
+  uint64_t elapsed = nanos_monotonic() - start;
+  printf("%-12s %8.2f ns/frame  (%u)\n", name, (double)elapsed / ((double)frames.size() * iterations), acc & 0xFF);
+}
+
+int main(int argc, char **argv) {
+  std::string path;
+  int iterations = 100;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--iterations" && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else {
+      path = arg;
+    }
+  }
+
+  std::vector<Frame> frames = path.empty() ? random_frames(100000) : load_frames(path);
+  if (frames.empty()) {
+    fprintf(stderr, "no can frames in %s\n", path.c_str());
+    return 1;
+  }
+  printf("%zu frames, %d iterations\n", frames.size(), iterations);
+
+  run("honda", frames, iterations, [](const Frame &f) { return honda_checksum(f.address, f.dat_be, f.size); });
+  run("toyota", frames, iterations, [](const Frame &f) { return toyota_checksum(f.address, f.dat_be, f.size); });
+  run("subaru", frames, iterations, [](const Frame &f) { return subaru_checksum(f.address, f.dat_be, f.size); });
+  run("chrysler", frames, iterations, [](const Frame &f) { return chrysler_checksum(f.address, f.dat_le, f.size); });
+  run("volkswagen", frames, iterations, [](const Frame &f) { return volkswagen_crc(0x86, f.dat_le, f.size); });
+  run("pedal", frames, iterations, [](const Frame &f) { return pedal_checksum(f.dat_be, f.size); });
+  return 0;
+}
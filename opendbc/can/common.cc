@@ -1,13 +1,22 @@
 #include "common.h"
 
+// Sum of the 16 nibbles / 8 bytes of d, summed pairwise in wide lanes instead of one at a time
+static inline unsigned int nibble_sum(uint64_t d) {
+  d = (d & 0x0F0F0F0F0F0F0F0FULL) + ((d >> 4) & 0x0F0F0F0F0F0F0F0FULL); // 8 lanes of at most 30
+  return (d * 0x0101010101010101ULL) >> 56; // at most 240, no carry out of the top lane
+}
+
+static inline unsigned int byte_sum(uint64_t d) {
+  d = (d & 0x00FF00FF00FF00FFULL) + ((d >> 8) & 0x00FF00FF00FF00FFULL); // 4 lanes of at most 510
+  return (d * 0x0001000100010001ULL) >> 48;
+}
+
 unsigned int honda_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
   d >>= 4; // remove checksum
 
-  int s = 0;
   bool extended = address > 0x7FF; // extended can
-  while (address) { s += (address & 0xF); address >>= 4; }
-  while (d) { s += (d & 0xF); d >>= 4; }
+  int s = nibble_sum(address) + nibble_sum(d);
   s = 8-s;
   if (extended) s += 3;
   s &= 0xF;
@@ -19,79 +28,68 @@ unsigned int toyota_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
   d >>= 8; // remove checksum
 
-  unsigned int s = l;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  while (d) { s += d & 0xFF; d >>= 8; }
-
+  unsigned int s = l + byte_sum(address) + byte_sum(d);
   return s & 0xFF;
 }
 
 unsigned int subaru_checksum(unsigned int address, uint64_t d, int l) {
   d >>= ((8-l)*8); // remove padding
+  d &= (l > 1) ? (~0ULL >> ((9-l)*8)) : 0; // checksum is first byte
 
-  unsigned int s = 0;
-  while (address) { s += address & 0xFF; address >>= 8; }
-  l -= 1; // checksum is first byte
-  while (l) { s += d & 0xFF; d >>= 8; l -= 1; }
-
+  unsigned int s = byte_sum(address) + byte_sum(d);
   return s & 0xFF;
 }
 
-unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
-  /* This function does not want the checksum byte in the input data.
-  jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf */
-  uint8_t checksum = 0xFF;
-  for (int j = 0; j < (l - 1); j++) {
-    uint8_t shift = 0x80;
-    uint8_t curr = (d >> 8*j) & 0xFF;
-    for (int i=0; i<8; i++) {
-      uint8_t bit_sum = curr & shift;
-      uint8_t temp_chk = checksum & 0x80U;
-      if (bit_sum != 0U) {
-        bit_sum = 0x1C;
-        if (temp_chk != 0U) {
-          bit_sum = 1;
-        }
-        checksum = checksum << 1;
-        temp_chk = checksum | 1U;
-        bit_sum ^= temp_chk;
-      } else {
-        if (temp_chk != 0U) {
-          bit_sum = 0x1D;
-        }
-        checksum = checksum << 1;
-        bit_sum ^= checksum;
-      }
-      checksum = bit_sum;
-      shift = shift >> 1;
-    }
-  }
-  return ~checksum & 0xFF;
-}
-
-// Static lookup table for fast computation of CRC8 poly 0x2F, aka 8H2F/AUTOSAR
-uint8_t crc8_lut_8h2f[256];
-
-void gen_crc_lookup_table(uint8_t poly, uint8_t crc_lut[]) {
-  uint8_t crc;
-  int i, j;
-
-   for (i = 0; i < 256; i++) {
-    crc = i;
-    for (j = 0; j < 8; j++) {
+// Slice-by-8 lookup tables: lut[k][i] is the CRC of byte i followed by k zero bytes.
+// The CRC of up to 8 bytes is then one independent lookup per byte instead of a chain
+// of dependent lookups. The tables are built at compile time, so they are ready before
+// any checksum runs.
+struct CrcSliceTables {
+  uint8_t lut[8][256];
+};
+
+static constexpr CrcSliceTables gen_crc_slice_tables(uint8_t poly) {
+  CrcSliceTables t = {};
+  for (int i = 0; i < 256; i++) {
+    uint8_t crc = i;
+    for (int j = 0; j < 8; j++) {
       if ((crc & 0x80) != 0)
         crc = (uint8_t)((crc << 1) ^ poly);
       else
         crc <<= 1;
     }
-    crc_lut[i] = crc;
+    t.lut[0][i] = crc;
   }
+  for (int k = 1; k < 8; k++) {
+    for (int i = 0; i < 256; i++) {
+      t.lut[k][i] = t.lut[0][t.lut[k-1][i]];
+    }
+  }
+  return t;
 }
 
-void init_crc_lookup_tables() {
-  // At init time, set up static lookup tables for fast CRC computation.
+static constexpr CrcSliceTables crc8_8h2f = gen_crc_slice_tables(0x2F);   // CRC-8 8H2F/AUTOSAR for Volkswagen
+static constexpr CrcSliceTables crc8_j1850 = gen_crc_slice_tables(0x1D);  // CRC-8 SAE J1850 for Chrysler
+static constexpr CrcSliceTables crc8_d5 = gen_crc_slice_tables(0xD5);     // CRC-8 for the comma pedal
+
+// CRC of the n bytes of d starting at byte start, least significant byte first, n <= 8
+static inline uint8_t crc8_sliced(const uint8_t crc_lut[8][256], uint8_t crc, uint64_t d, int start, int n) {
+  if (n <= 0) return crc;
+
+  d >>= start*8;
+  uint8_t r = crc_lut[n-1][(d & 0xFF) ^ crc];
+  for (int i = 1; i < n; i++) {
+    r ^= crc_lut[n-1-i][(d >> (i*8)) & 0xFF];
+  }
+  return r;
+}
 
-  gen_crc_lookup_table(0x2F, crc8_lut_8h2f);    // CRC-8 8H2F/AUTOSAR for Volkswagen
+unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l) {
+  /* This function does not want the checksum byte in the input data.
+  jeep chrysler canbus checksum from http://illmatics.com/Remote%20Car%20Hacking.pdf
+  It is the SAE J1850 CRC8: poly 0x1D, init 0xFF and final XOR 0xFF. */
+  uint8_t checksum = crc8_sliced(crc8_j1850.lut, 0xFF, d, 0, l - 1);
+  return ~checksum & 0xFF;
 }
 
 unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
@@ -99,13 +97,9 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
   // a magic variable padding byte tacked onto the end of the payload.
   // https://www.autosar.org/fileadmin/user_upload/standards/classic/4-3/AUTOSAR_SWS_CRCLibrary.pdf
 
-  uint8_t crc = 0xFF; // Standard init value for CRC8 8H2F/AUTOSAR
-
   // CRC the payload first, skipping over the first byte where the CRC lives.
-  for (int i = 1; i < l; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
-    crc = crc8_lut_8h2f[crc];
-  }
+  // 0xFF is the standard init value for CRC8 8H2F/AUTOSAR.
+  uint8_t crc = crc8_sliced(crc8_8h2f.lut, 0xFF, d, 1, l - 1);
 
   // Look up and apply the magic final CRC padding byte, which permutes by CAN
   // address, and additionally (for SOME addresses) by the message counter.
@@ -167,32 +161,17 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l) {
       crc ^= (uint8_t[]){0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00}[counter];
       break;
   }
-  crc = crc8_lut_8h2f[crc];
+  crc = crc8_8h2f.lut[0][crc];
 
   return crc ^ 0xFF; // Return after standard final XOR for CRC8 8H2F/AUTOSAR
 }
 
 
 unsigned int pedal_checksum(uint64_t d, int l) {
-  uint8_t crc = 0xFF;
-  uint8_t poly = 0xD5; // standard crc8
-
   d >>= ((8-l)*8); // remove padding
   d >>= 8; // remove checksum
 
-  int i, j;
-  for (i = 0; i < l - 1; i++) {
-    crc ^= (d >> (i*8)) & 0xFF;
-    for (j = 0; j < 8; j++) {
-      if ((crc & 0x80) != 0) {
-        crc = (uint8_t)((crc << 1) ^ poly);
-      }
-      else {
-        crc <<= 1;
-      }
-    }
-  }
-  return crc;
+  return crc8_sliced(crc8_d5.lut, 0xFF, d, 0, l - 1); // standard crc8, poly 0xD5
 }
 
 
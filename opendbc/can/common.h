@@ -1,7 +1,9 @@
 #pragma once
 
+#include <algorithm>
 #include <vector>
 #include <map>
+#include <queue>
 #include <unordered_map>
 
 #include "common_dbc.h"
@@ -15,36 +17,68 @@
 #define MAX_BAD_COUNTER 5
 
 // Helper functions
-unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
-unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
-unsigned int subaru_checksum(unsigned int address, uint64_t d, int l);
-unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l);
-void init_crc_lookup_tables();
-unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
-unsigned int pedal_checksum(uint64_t d, int l);
 uint64_t read_u64_be(const uint8_t* v);
 uint64_t read_u64_le(const uint8_t* v);
 
+// Signals of all tracked messages, one array per field so parsing a message walks
+// contiguous memory. Each message owns the range [sig_start, sig_start + num_sigs).
+struct SignalTable {
+  std::vector<const char*> names;
+  std::vector<uint8_t> shifts; // b1 for little endian signals, bo for big endian signals
+  std::vector<uint8_t> little_endian;
+  std::vector<uint64_t> masks;
+  std::vector<uint64_t> sign_bits; // Top bit of signed signals, 0 for unsigned
+  std::vector<double> factors, offsets;
+  std::vector<SignalType> types;
+  std::vector<uint16_t> dbc_index; // Index in Msg::sigs, where the generated parse function puts the value
+  std::vector<double> vals;
+  std::vector<double> scratch; // Output of the generated parse functions
+
+  // Ring buffers of history_size values per signal, filled when the history is enabled
+  size_t history_size = 0;
+  std::vector<double> history;
+
+  size_t add(const Signal &sig, uint16_t index, double default_value);
+  inline int64_t extract(size_t i, uint64_t dat_le, uint64_t dat_be) const {
+    uint64_t tmp = ((little_endian[i] ? dat_le : dat_be) >> shifts[i]) & masks[i];
+    return (int64_t)((tmp ^ sign_bits[i]) - sign_bits[i]);
+  }
+};
+
 class MessageState {
 public:
-  uint32_t address;
-  unsigned int size;
+  uint32_t address = 0;
+  unsigned int size = 0;
 
-  std::vector<Signal> parse_sigs;
-  std::vector<double> vals;
+  size_t sig_start = 0;
+  size_t num_sigs = 0;
+  int checksum_sig = -1; // Index in the signal table, -1 if the message has none
+  int counter_sig = -1;
 
-  uint16_t ts;
-  uint64_t seen;
-  uint64_t check_threshold;
+  // Specialized code from process_dbc.py, NULL for DBCs built without it
+  MsgParseFn parse_fn = NULL;
+  MsgChecksumFn checksum_fn = NULL;
+  bool parse_in_place = false; // All signals are tracked in DBC order, parse_fn can write the values directly
 
-  uint8_t counter;
-  uint8_t counter_fail;
+  uint16_t ts = 0;
+  uint64_t seen = 0;
+  uint64_t check_threshold = 0;
+
+  uint8_t counter = 0;
+  uint8_t counter_fail = 0;
 
   bool ignore_checksum = false;
   bool ignore_counter = false;
 
-  bool parse(uint64_t sec, uint16_t ts_, uint8_t * dat);
+  std::vector<uint64_t> history_ts;
+  size_t history_count = 0;
+  size_t history_next = 0;
+
+  void init(const Msg *msg, SignalTable &signals);
+  void add_signal(SignalTable &signals, const Msg *msg, int index, double default_value);
+  bool parse(uint64_t sec, uint16_t ts_, const uint8_t * dat, SignalTable &signals);
   bool update_counter_generic(int64_t v, int cnt_size);
+  void append_history(uint64_t sec, SignalTable &signals);
 };
 
 class CANParser {
@@ -53,11 +87,35 @@ private:
   kj::Array<capnp::word> aligned_buf;
 
   const DBC *dbc = NULL;
-  std::unordered_map<uint32_t, MessageState> message_states;
+  SignalTable signals;
+  std::vector<MessageState> message_states; // Sorted by address
+
+  // Index into message_states by address, direct-mapped for 11-bit addresses
+  std::vector<int16_t> direct_index;
+  std::vector<std::pair<uint32_t, int16_t>> extended_index; // Sorted by address
+
+  // Messages with a check_threshold are either waiting in the deadline heap or expired.
+  // A heap entry can be older than the last frame, it is refreshed when it reaches the top.
+  typedef std::pair<uint64_t, int> Deadline; // (seen + check_threshold, index in message_states)
+  std::priority_queue<Deadline, std::vector<Deadline>, std::greater<Deadline>> deadlines;
+  std::vector<int> expired;
+
+  void init_index();
+  inline MessageState *lookup(uint32_t address) {
+    int16_t idx = -1;
+    if (address < direct_index.size()) {
+      idx = direct_index[address];
+    } else {
+      auto it = std::lower_bound(extended_index.begin(), extended_index.end(), std::make_pair(address, (int16_t)-1));
+      if (it != extended_index.end() && it->first == address) idx = it->second;
+    }
+    return idx < 0 ? nullptr : &message_states[idx];
+  }
 
 public:
   bool can_valid = false;
   uint64_t last_sec = 0;
+  std::vector<uint32_t> timed_out; // Addresses of the checked messages missing at the last UpdateValid, sorted
 
   CANParser(int abus, const std::string& dbc_name,
             const std::vector<MessageParseOptions> &options,
@@ -66,20 +124,108 @@ public:
   #ifndef DYNAMIC_CAPNP
   void update_string(const std::string &data, bool sendcan);
   void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans);
+  // Parses one frame already known to be on this parser's bus
+  void UpdateCan(uint64_t sec, const cereal::CanData::Reader& cmsg);
   #endif
   void UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cans);
   void UpdateValid(uint64_t sec);
   std::vector<SignalValue> query_latest();
+  int get_bus() const { return bus; }
+
+  // Keeps every decoded value instead of only the latest, up to size values per signal between queries
+  void set_history_size(size_t size);
+  // The arrays point into the parser and stay valid until the next update
+  void query_history(std::vector<SignalHistory> &out);
+};
+
+// Feeds several parsers, usually one per bus, from a single pass over the can list.
+// Each frame is read once and handed to the parsers of its src bus. The parsers are
+// not owned and keep their own values and validity.
+class CANParserGroup {
+private:
+  std::vector<CANParser*> parsers;
+  std::vector<std::vector<CANParser*>> bus_parsers; // Indexed by src
+  kj::Array<capnp::word> aligned_buf;
+
+public:
+  uint64_t last_sec = 0; // logMonoTime of the last event
+
+  CANParserGroup(const std::vector<CANParser*> &parsers);
+  #ifndef DYNAMIC_CAPNP
+  void update_string(const std::string &data, bool sendcan);
+  void UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans);
+  #endif
+  void UpdateValid(uint64_t sec);
+  bool can_valid() const;
+};
+
+// Values of one signal decoded from whole logs, in log order
+struct SignalColumn {
+  uint32_t address;
+  std::string name;
+  std::vector<uint64_t> ts; // logMonoTime of the can event each value came from
+  std::vector<double> values;
+};
+
+#ifndef DYNAMIC_CAPNP
+// Reads a whole rlog into buf, bz2 compressed or not. Returns what went wrong, or an empty string
+std::string read_log(const std::string &path, kj::Array<capnp::word> &buf);
+
+// Decodes every frame of bus in whole segments of serialized events, instead of one
+// update_string per event. The segments are decoded on up to threads threads (0 for one
+// per core) and the columns are concatenated in segment order, sorted by address.
+// errors gets one entry per segment, empty unless the segment was unreadable or corrupt.
+// A corrupt segment still contributes the events before the corruption.
+std::vector<SignalColumn> decode_can_segments(const std::string &dbc_name, int bus,
+                                              const std::vector<std::string> &segments, int threads,
+                                              std::vector<std::string> &errors);
+// The same for the paths of rlogs, each one read on its decoding thread. Segments and logs may be bz2 compressed
+std::vector<SignalColumn> decode_can_files(const std::string &dbc_name, int bus,
+                                           const std::vector<std::string> &paths, int threads,
+                                           std::vector<std::string> &errors);
+#endif
+
+// Signal of a pack plan with the mask and shift in the packed (big endian) layout
+struct PackSignal {
+  uint64_t mask;
+  uint64_t value_mask; // Low b2 bits
+  uint8_t shift;
+  bool little_endian;
+  double factor, offset;
+  SignalType type;
+};
+
+// Everything pack needs for one message, resolved when the packer is created
+struct PackPlan {
+  const Msg *msg = NULL;
+  std::vector<PackSignal> sigs; // In Msg::sigs order
+  std::unordered_map<std::string, int> signal_index;
+  int counter_sig = -1;
+  int checksum_sig = -1;
 };
 
 class CANPacker {
 private:
   const DBC *dbc = NULL;
-  std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
-  std::map<uint32_t, Msg> message_lookup;
+  std::vector<PackPlan> plans;
+  std::unordered_map<uint32_t, size_t> plan_index;
+
+  uint64_t set_counter_checksum(const PackPlan &plan, uint64_t ret, int counter);
+  uint64_t pack(const PackPlan &plan, const std::vector<SignalPackIndexValue> &values, int counter);
 
 public:
   CANPacker(const std::string& dbc_name);
   uint64_t pack(uint32_t address, const std::vector<SignalPackValue> &values, int counter);
-  Msg* lookup_message(uint32_t address);
+  uint64_t pack(uint32_t address, const std::vector<SignalPackIndexValue> &values, int counter);
+  // Index of the signal for the SignalPackIndexValue overloads, -1 if the message or signal is unknown
+  int signal_index(uint32_t address, const std::string &name);
+  const PackPlan* lookup_plan(uint32_t address);
+  const Msg* lookup_message(uint32_t address);
+
+  #ifndef DYNAMIC_CAPNP
+  // Packs a whole control step into the sendcan list of event. Requests for messages the DBC doesn't have are skipped
+  void pack_sendcan(const std::vector<CanPackRequest> &requests, cereal::Event::Builder event);
+  // Serialized sendcan event, ready to publish
+  void pack_sendcan(const std::vector<CanPackRequest> &requests, bool valid, std::string &out);
+  #endif
 };
@@ -1,7 +1,7 @@
 # distutils: language = c++
 #cython: language_level=3
 
-from libc.stdint cimport uint32_t, uint64_t, uint16_t
+from libc.stdint cimport uint8_t, uint32_t, uint64_t, uint16_t
 from libcpp.vector cimport vector
 from libcpp.map cimport map
 from libcpp.string cimport string
@@ -65,20 +65,57 @@ cdef extern from "common_dbc.h":
     const char* name
     double value
 
+  cdef struct SignalHistory:
+    uint32_t address
+    const char* name
+    size_t count
+    const uint64_t* ts
+    const double* values
+
   cdef struct SignalPackValue:
     string name
     double value
 
+  cdef struct SignalPackIndexValue:
+    int index
+    double value
+
+  cdef struct CanPackRequest:
+    uint32_t address
+    uint8_t bus
+    vector[SignalPackIndexValue] values
+    int counter
+
 
 cdef extern from "common.h":
   cdef const DBC* dbc_lookup(const string);
 
   cdef cppclass CANParser:
     bool can_valid
+    vector[uint32_t] timed_out
     CANParser(int, string, vector[MessageParseOptions], vector[SignalParseOptions])
     void update_string(string, bool)
     vector[SignalValue] query_latest()
+    void set_history_size(size_t)
+    void query_history(vector[SignalHistory]&)
+
+  cdef cppclass CANParserGroup:
+    uint64_t last_sec
+    CANParserGroup(vector[CANParser*])
+    void update_string(string, bool)
+    bool can_valid()
+
+  cdef cppclass SignalColumn:
+    uint32_t address
+    string name
+    vector[uint64_t] ts
+    vector[double] values
+
+  vector[SignalColumn] decode_can_segments(string, int, vector[string], int, vector[string]&) nogil
+  vector[SignalColumn] decode_can_files(string, int, vector[string], int, vector[string]&) nogil
 
   cdef cppclass CANPacker:
    CANPacker(string)
    uint64_t pack(uint32_t, vector[SignalPackValue], int counter)
+   uint64_t pack(uint32_t, vector[SignalPackIndexValue], int counter)
+   void pack_sendcan(vector[CanPackRequest], bool, string&)
@@ -12,6 +12,20 @@ struct SignalPackValue {
   double value;
 };
 
+// A signal resolved once through CANPacker::signal_index, packed without a name lookup
+struct SignalPackIndexValue {
+  int index;
+  double value;
+};
+
+// One frame of a sendcan batch, a counter < 0 leaves the counter untouched
+struct CanPackRequest {
+  uint32_t address;
+  uint8_t bus;
+  std::vector<SignalPackIndexValue> values;
+  int counter;
+};
+
 struct SignalParseOptions {
   uint32_t address;
   const char* name;
@@ -30,6 +44,15 @@ struct SignalValue {
   double value;
 };
 
+// Every value of a signal decoded since the previous query, oldest first
+struct SignalHistory {
+  uint32_t address;
+  const char* name;
+  size_t count;
+  const uint64_t* ts; // Time of the can event each value came from
+  const double* values;
+};
+
 enum SignalType {
   DEFAULT,
   HONDA_CHECKSUM,
@@ -52,12 +75,19 @@ struct Signal {
   SignalType type;
 };
 
+// Decodes every signal of a message into vals, in the order of Msg::sigs
+typedef void (*MsgParseFn)(uint64_t dat_le, uint64_t dat_be, double *vals);
+// Returns true if the checksum signal of a message matches its data
+typedef bool (*MsgChecksumFn)(uint64_t dat_le, uint64_t dat_be);
+
 struct Msg {
   const char* name;
   uint32_t address;
   unsigned int size;
   size_t num_sigs;
   const Signal *sigs;
+  MsgParseFn parse; // Generated per message by process_dbc.py, optional
+  MsgChecksumFn checksum;
 };
 
 struct Val {
@@ -75,9 +105,25 @@ struct DBC {
   size_t num_vals;
 };
 
+// Checksum functions, also called from the generated parse code
+unsigned int honda_checksum(unsigned int address, uint64_t d, int l);
+unsigned int toyota_checksum(unsigned int address, uint64_t d, int l);
+unsigned int subaru_checksum(unsigned int address, uint64_t d, int l);
+unsigned int chrysler_checksum(unsigned int address, uint64_t d, int l);
+unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
+unsigned int pedal_checksum(uint64_t d, int l);
+
 std::vector<const DBC*>& get_dbcs();
+// Compiled in DBCs first, then <name>.dbc from DBC_PATH through dbc_load
 const DBC* dbc_lookup(const std::string& dbc_name);
 
+// Runtime loading (dbc_loader.cc). dbc_compile parses a .dbc file into a compact blob,
+// dbc_load_blob maps one. dbc_load does both, keeping the blobs in DBC_CACHE_DIR.
+// Loaded DBCs stay valid for the lifetime of the process and have no generated parse functions.
+bool dbc_compile(const std::string& dbc_fn, const std::string& blob_fn);
+const DBC* dbc_load_blob(const std::string& blob_fn);
+const DBC* dbc_load(const std::string& dbc_name);
+
 void dbc_register(const DBC* dbc);
 
 #define dbc_init(dbc) \
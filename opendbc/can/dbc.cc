@@ -1,23 +1,51 @@
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
 #include "common_dbc.h"
 
+static std::mutex& get_dbcs_lock() {
+  static std::mutex lock;
+  return lock;
+}
+
+static std::unordered_map<std::string, const DBC*>& get_dbc_index() {
+  static std::unordered_map<std::string, const DBC*> index;
+  return index;
+}
+
 std::vector<const DBC*>& get_dbcs() {
   static std::vector<const DBC*> vec;
   return vec;
 }
 
 const DBC* dbc_lookup(const std::string& dbc_name) {
-  for (const auto& dbci : get_dbcs()) {
-    if (dbc_name == dbci->name) {
-      return dbci;
+  {
+    std::lock_guard<std::mutex> lk(get_dbcs_lock());
+    auto it = get_dbc_index().find(dbc_name);
+    if (it != get_dbc_index().end()) {
+      return it->second;
+    }
+  }
+
+  // Not built into libdbc, compile the .dbc file at runtime through the on-disk cache
+  const DBC* dbc = dbc_load(dbc_name);
+  if (dbc != NULL) {
+    std::lock_guard<std::mutex> lk(get_dbcs_lock());
+    auto it = get_dbc_index().find(dbc_name);
+    if (it != get_dbc_index().end()) {
+      return it->second; // Another thread loaded it first, the mapping is kept
     }
+    get_dbcs().push_back(dbc);
+    get_dbc_index()[dbc->name] = dbc;
   }
-  return NULL;
+  return dbc;
 }
 
 void dbc_register(const DBC* dbc) {
+  std::lock_guard<std::mutex> lk(get_dbcs_lock());
   get_dbcs().push_back(dbc);
+  get_dbc_index()[dbc->name] = dbc;
 }
 
 extern "C" {
@@ -0,0 +1,477 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <regex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common_dbc.h"
+
+#define WARN printf
+
+// Runtime counterpart of dbc.py and process_dbc.py: a .dbc file is parsed once into a blob of
+// fixed size records and a string table, which is then mmapped by every process that uses it.
+// Only the Msg/Signal/Val arrays with pointers into the mapping are built on the heap.
+
+#define DBC_BLOB_MAGIC 0x31434244 // "DBC1"
+#define DBC_BLOB_VERSION 1
+
+struct DBCBlobHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t source_size; // Of the .dbc file, a changed file recompiles the blob
+  int64_t source_mtime;
+  uint32_t name;
+  uint32_t num_msgs;
+  uint32_t num_sigs;
+  uint32_t num_vals;
+  uint32_t strings_size;
+};
+
+struct DBCBlobMsg {
+  uint32_t name; // Offset in the string table
+  uint32_t address;
+  uint32_t size;
+  uint32_t sig_start;
+  uint32_t num_sigs;
+};
+
+struct DBCBlobSignal {
+  uint32_t name;
+  int32_t b1, b2, bo;
+  double factor, offset;
+  uint8_t is_signed;
+  uint8_t is_little_endian;
+  uint8_t type;
+};
+
+struct DBCBlobVal {
+  uint32_t name;
+  uint32_t address;
+  uint32_t def_val;
+  int32_t msg; // Index of the message owning the signals, -1 if it has none
+};
+
+struct LoadedDBC {
+  DBC dbc;
+  std::vector<Msg> msgs;
+  std::vector<Signal> sigs;
+  std::vector<Val> vals;
+};
+
+namespace {
+
+struct ParsedSignal {
+  std::string name;
+  int start_bit, size;
+  bool is_little_endian, is_signed;
+  double factor, offset;
+};
+
+struct ParsedMsg {
+  std::string name;
+  uint32_t size;
+  std::vector<ParsedSignal> sigs;
+};
+
+class StringTable {
+public:
+  uint32_t add(const std::string &s) {
+    auto it = offsets.find(s);
+    if (it != offsets.end()) return it->second;
+
+    uint32_t offset = data.size();
+    data.insert(data.end(), s.begin(), s.end());
+    data.push_back('\0');
+    offsets[s] = offset;
+    return offset;
+  }
+  std::vector<char> data;
+
+private:
+  std::map<std::string, uint32_t> offsets;
+};
+
+// Same rules as signal_type in process_dbc.py
+const char *checksum_type(const std::string &dbc_name) {
+  auto starts_with = [&](std::initializer_list<const char *> prefixes) {
+    for (auto p : prefixes) {
+      if (dbc_name.compare(0, strlen(p), p) == 0) return true;
+    }
+    return false;
+  };
+  if (starts_with({"honda_", "acura_"})) return "honda";
+  if (starts_with({"toyota_", "lexus_"})) return "toyota";
+  if (starts_with({"vw_", "volkswagen_", "audi_", "seat_", "skoda_"})) return "volkswagen";
+  if (starts_with({"subaru_global_"})) return "subaru";
+  if (starts_with({"chrysler_", "stellantis_"})) return "chrysler";
+  return NULL;
+}
+
+SignalType signal_type(const char *checksum, uint32_t address, const std::string &name) {
+  if ((address == 512 || address == 513) && name == "CHECKSUM_PEDAL") return SignalType::PEDAL_CHECKSUM;
+  if ((address == 512 || address == 513) && name == "COUNTER_PEDAL") return SignalType::PEDAL_COUNTER;
+  if (checksum == NULL) return SignalType::DEFAULT;
+
+  std::string type = checksum;
+  if (name == "CHECKSUM") {
+    if (type == "honda") return SignalType::HONDA_CHECKSUM;
+    if (type == "toyota") return SignalType::TOYOTA_CHECKSUM;
+    if (type == "volkswagen") return SignalType::VOLKSWAGEN_CHECKSUM;
+    if (type == "subaru") return SignalType::SUBARU_CHECKSUM;
+    if (type == "chrysler") return SignalType::CHRYSLER_CHECKSUM;
+  } else if (name == "COUNTER") {
+    if (type == "honda") return SignalType::HONDA_COUNTER;
+    if (type == "volkswagen") return SignalType::VOLKSWAGEN_COUNTER;
+  }
+  return SignalType::DEFAULT;
+}
+
+// VAL_ value descriptions as dbc.py formats them: upper case names, spaces replaced by underscores
+std::string format_def_val(const std::string &defvals) {
+  std::vector<std::string> parts;
+  size_t pos = 0;
+  while (true) {
+    size_t end = defvals.find('"', pos);
+    if (end == std::string::npos) break; // The part after the last quote is dropped
+    parts.push_back(defvals.substr(pos, end - pos));
+    pos = end + 1;
+  }
+
+  std::string ret;
+  for (size_t i = 0; i < parts.size(); i++) {
+    std::string part = parts[i];
+    if (i % 2 == 1) {
+      size_t b = part.find_first_not_of(" \t"), e = part.find_last_not_of(" \t");
+      part = b == std::string::npos ? "" : part.substr(b, e - b + 1);
+      for (auto &c : part) c = c == ' ' ? '_' : toupper(c);
+    }
+    ret += part;
+  }
+  return ret;
+}
+
+std::string dbc_dir() {
+  const char *env = getenv("DBC_PATH");
+  if (env != NULL) return env;
+
+  // libdbc lives in opendbc/can, the .dbc files one level up
+  Dl_info info;
+  if (dladdr((void *)&dbc_compile, &info) != 0 && info.dli_fname != NULL) {
+    std::string path = info.dli_fname;
+    return std::string(dirname(&path[0])) + "/..";
+  }
+  return ".";
+}
+
+// Blobs are trusted once their header matches, so only a directory private to this user is used
+std::string cache_dir() {
+  const char *env = getenv("DBC_CACHE_DIR");
+  std::string dir = env != NULL ? env : "/tmp/dbc_cache_" + std::to_string(getuid());
+  mkdir(dir.c_str(), 0700);
+
+  struct stat st;
+  if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+    WARN("not using DBC cache %s, it must be a directory only accessible by its owner\n", dir.c_str());
+    return "";
+  }
+  return dir;
+}
+
+// Rejects signals the parser and packer can't shift and mask within a 64 bit frame
+bool valid_signal(const DBCBlobSignal &s) {
+  return s.b1 >= 0 && s.b1 < 64 && s.b2 >= 1 && s.b2 <= 64 && s.bo >= 0 && s.bo < 64 && s.type <= CHRYSLER_CHECKSUM;
+}
+
+const DBC* map_blob(const std::string &blob_fn, const struct stat *source) {
+  int fd = open(blob_fn.c_str(), O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DBCBlobHeader) || st.st_uid != getuid()) {
+    close(fd);
+    return NULL;
+  }
+  size_t size = st.st_size;
+  void *mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return NULL;
+
+  const char *data = (const char *)mem;
+  const DBCBlobHeader *header = (const DBCBlobHeader *)data;
+  // Each table has to fit in what's left of the file
+  size_t offset = sizeof(DBCBlobHeader);
+  auto table = [&](size_t count, size_t item_size, size_t &table_offset) {
+    table_offset = offset;
+    if (count > (size - offset) / item_size) return false;
+    offset += count * item_size;
+    return true;
+  };
+  size_t msgs_offset, sigs_offset, vals_offset, strings_offset;
+  bool valid = header->magic == DBC_BLOB_MAGIC && header->version == DBC_BLOB_VERSION &&
+               table(header->num_msgs, sizeof(DBCBlobMsg), msgs_offset) &&
+               table(header->num_sigs, sizeof(DBCBlobSignal), sigs_offset) &&
+               table(header->num_vals, sizeof(DBCBlobVal), vals_offset) &&
+               table(header->strings_size, 1, strings_offset) &&
+               offset == size && header->strings_size > 0 && data[size - 1] == '\0';
+  if (valid && source != NULL) {
+    valid = header->source_size == (uint64_t)source->st_size && header->source_mtime == (int64_t)source->st_mtime;
+  }
+  if (!valid) {
+    munmap(mem, size);
+    return NULL;
+  }
+
+  const DBCBlobMsg *blob_msgs = (const DBCBlobMsg *)(data + msgs_offset);
+  const DBCBlobSignal *blob_sigs = (const DBCBlobSignal *)(data + sigs_offset);
+  const DBCBlobVal *blob_vals = (const DBCBlobVal *)(data + vals_offset);
+  const char *strings = data + strings_offset;
+  auto str = [&](uint32_t offset) { return offset < header->strings_size ? strings + offset : ""; };
+
+  // Never freed, like the DBCs compiled into libdbc
+  LoadedDBC *loaded = new LoadedDBC;
+  loaded->sigs.resize(header->num_sigs);
+  for (size_t i = 0; i < header->num_sigs; i++) {
+    const DBCBlobSignal &s = blob_sigs[i];
+    if (!valid_signal(s)) valid = false;
+    loaded->sigs[i] = {
+      .name = str(s.name),
+      .b1 = s.b1,
+      .b2 = s.b2,
+      .bo = s.bo,
+      .is_signed = s.is_signed != 0,
+      .factor = s.factor,
+      .offset = s.offset,
+      .is_little_endian = s.is_little_endian != 0,
+      .type = (SignalType)s.type,
+    };
+  }
+
+  loaded->msgs.resize(header->num_msgs);
+  for (size_t i = 0; i < header->num_msgs; i++) {
+    const DBCBlobMsg &m = blob_msgs[i];
+    if ((uint64_t)m.sig_start + m.num_sigs > header->num_sigs || m.size > 8) valid = false;
+    loaded->msgs[i] = {
+      .name = str(m.name),
+      .address = m.address,
+      .size = m.size,
+      .num_sigs = valid ? m.num_sigs : 0,
+      .sigs = valid ? &loaded->sigs[m.sig_start] : NULL,
+    };
+  }
+
+  loaded->vals.resize(header->num_vals);
+  for (size_t i = 0; i < header->num_vals; i++) {
+    const DBCBlobVal &v = blob_vals[i];
+    bool has_msg = v.msg >= 0 && v.msg < (int32_t)header->num_msgs;
+    loaded->vals[i] = {
+      .name = str(v.name),
+      .address = v.address,
+      .def_val = str(v.def_val),
+      .sigs = has_msg ? loaded->msgs[v.msg].sigs : NULL,
+    };
+  }
+
+  loaded->dbc = {
+    .name = str(header->name),
+    .num_msgs = loaded->msgs.size(),
+    .msgs = loaded->msgs.data(),
+    .vals = loaded->vals.data(),
+    .num_vals = loaded->vals.size(),
+  };
+
+  if (!valid) {
+    WARN("corrupt DBC blob %s\n", blob_fn.c_str());
+    delete loaded;
+    munmap(mem, size);
+    return NULL;
+  }
+  return &loaded->dbc;
+}
+
+}
+
+bool dbc_compile(const std::string& dbc_fn, const std::string& blob_fn) {
+  std::ifstream f(dbc_fn);
+  if (!f) return false;
+
+  std::string dbc_name = dbc_fn.substr(dbc_fn.find_last_of('/') + 1);
+  dbc_name = dbc_name.substr(0, dbc_name.find_last_of('.'));
+
+  // regexps from dbc.py
+  static const std::regex bo_regexp(R"(^BO\_ (\w+) (\w+) *: (\w+) (\w+))");
+  static const std::regex sg_regexp(R"(^SG\_ (\w+) : (\d+)\|(\d+)@(\d+)([\+|\-]) \(([0-9.+\-eE]+),([0-9.+\-eE]+)\) \[([0-9.+\-eE]+)\|([0-9.+\-eE]+)\] \"(.*)\" (.*))");
+  static const std::regex sgm_regexp(R"(^SG\_ (\w+) (\w+) *: (\d+)\|(\d+)@(\d+)([\+|\-]) \(([0-9.+\-eE]+),([0-9.+\-eE]+)\) \[([0-9.+\-eE]+)\|([0-9.+\-eE]+)\] \"(.*)\" (.*))");
+  static const std::regex val_regexp(R"(VAL\_ (\w+) (\w+) (\s*[-+]?[0-9]+\s+\".+?\"[^;]*))");
+
+  std::map<uint32_t, ParsedMsg> msgs;
+  std::map<uint32_t, std::set<std::pair<std::string, std::string>>> def_vals;
+  ParsedMsg *current = NULL;
+
+  std::string line;
+  while (std::getline(f, line)) {
+    size_t b = line.find_first_not_of(" \t\r\n"), e = line.find_last_not_of(" \t\r\n");
+    if (b == std::string::npos) continue;
+    line = line.substr(b, e - b + 1);
+
+    std::smatch dat;
+    if (line.compare(0, 4, "BO_ ") == 0) {
+      if (!std::regex_search(line, dat, bo_regexp)) {
+        WARN("bad BO %s\n", line.c_str());
+        return false;
+      }
+      uint32_t address = strtoul(dat[1].str().c_str(), NULL, 0);
+      if (msgs.count(address)) {
+        WARN("Duplicate address detected %d %s\n", address, dbc_name.c_str());
+        return false;
+      }
+      current = &msgs[address];
+      current->name = dat[2];
+      current->size = strtoul(dat[3].str().c_str(), NULL, 10);
+    } else if (line.compare(0, 4, "SG_ ") == 0) {
+      int go = 0;
+      if (!std::regex_search(line, dat, sg_regexp)) {
+        go = 1;
+        if (!std::regex_search(line, dat, sgm_regexp)) {
+          WARN("bad SG %s\n", line.c_str());
+          return false;
+        }
+      }
+      if (current == NULL) return false;
+      current->sigs.push_back({
+        .name = dat[1],
+        .start_bit = atoi(dat[go + 2].str().c_str()),
+        .size = atoi(dat[go + 3].str().c_str()),
+        .is_little_endian = atoi(dat[go + 4].str().c_str()) == 1,
+        .is_signed = dat[go + 5] == "-",
+        .factor = strtod(dat[go + 6].str().c_str(), NULL),
+        .offset = strtod(dat[go + 7].str().c_str(), NULL),
+      });
+    } else if (line.compare(0, 5, "VAL_ ") == 0) {
+      if (!std::regex_search(line, dat, val_regexp)) {
+        WARN("bad VAL %s\n", line.c_str());
+        return false;
+      }
+      uint32_t address = strtoul(dat[1].str().c_str(), NULL, 0);
+      def_vals[address].insert({dat[2], format_def_val(dat[3])});
+    }
+  }
+
+  // Same layout as the generated code: messages by address, COUNTER and CHECKSUM first, then by start bit
+  const char *checksum = checksum_type(dbc_name);
+  StringTable strings;
+  std::vector<DBCBlobMsg> blob_msgs;
+  std::vector<DBCBlobSignal> blob_sigs;
+  std::map<uint32_t, int32_t> msg_index;
+  for (auto &[address, msg] : msgs) {
+    if (msg.sigs.empty()) continue;
+
+    auto &sigs = msg.sigs;
+    std::stable_sort(sigs.begin(), sigs.end(), [](auto &a, auto &b) { return a.start_bit < b.start_bit; });
+    std::stable_sort(sigs.begin(), sigs.end(), [](auto &a, auto &b) {
+      auto first = [](auto &s) { return s.name == "COUNTER" || s.name == "CHECKSUM"; };
+      return first(a) && !first(b);
+    });
+
+    msg_index[address] = blob_msgs.size();
+    const uint32_t sig_start = blob_sigs.size();
+    for (auto &sig : sigs) {
+      // Same as signal_b1 in process_dbc.py
+      int b1 = sig.is_little_endian ? sig.start_bit : (sig.start_bit / 8) * 8 + (((-sig.start_bit - 1) % 8) + 8) % 8;
+      DBCBlobSignal blob_sig = {
+        .name = strings.add(sig.name),
+        .b1 = b1,
+        .b2 = sig.size,
+        .bo = 64 - (b1 + sig.size),
+        .factor = sig.factor,
+        .offset = sig.offset,
+        .is_signed = sig.is_signed,
+        .is_little_endian = sig.is_little_endian,
+        .type = (uint8_t)signal_type(checksum, address, sig.name),
+      };
+      if (!valid_signal(blob_sig)) {
+        WARN("%s: skipping %s in %s, it doesn't fit in the frame\n", dbc_name.c_str(), sig.name.c_str(), msg.name.c_str());
+        continue;
+      }
+      blob_sigs.push_back(blob_sig);
+    }
+    blob_msgs.push_back({strings.add(msg.name), address, msg.size, sig_start, (uint32_t)blob_sigs.size() - sig_start});
+  }
+
+  std::vector<DBCBlobVal> blob_vals;
+  for (auto &[address, vals] : def_vals) {
+    auto it = msg_index.find(address);
+    for (auto &[name, def_val] : vals) {
+      blob_vals.push_back({strings.add(name), address, strings.add(def_val), it != msg_index.end() ? it->second : -1});
+    }
+  }
+
+  struct stat st;
+  if (stat(dbc_fn.c_str(), &st) != 0) return false;
+
+  DBCBlobHeader header = {
+    .magic = DBC_BLOB_MAGIC,
+    .version = DBC_BLOB_VERSION,
+    .source_size = (uint64_t)st.st_size,
+    .source_mtime = (int64_t)st.st_mtime,
+    .name = strings.add(dbc_name),
+    .num_msgs = (uint32_t)blob_msgs.size(),
+    .num_sigs = (uint32_t)blob_sigs.size(),
+    .num_vals = (uint32_t)blob_vals.size(),
+    .strings_size = (uint32_t)strings.data.size(),
+  };
+
+  // Written next to the target and renamed, a concurrent loader never sees a partial blob
+  std::string tmp_fn = blob_fn + ".tmp" + std::to_string(getpid());
+  FILE *out = fopen(tmp_fn.c_str(), "wb");
+  if (out == NULL) return false;
+  bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+  ok &= fwrite(blob_msgs.data(), sizeof(DBCBlobMsg), blob_msgs.size(), out) == blob_msgs.size();
+  ok &= fwrite(blob_sigs.data(), sizeof(DBCBlobSignal), blob_sigs.size(), out) == blob_sigs.size();
+  ok &= fwrite(blob_vals.data(), sizeof(DBCBlobVal), blob_vals.size(), out) == blob_vals.size();
+  ok &= fwrite(strings.data.data(), 1, strings.data.size(), out) == strings.data.size();
+  ok &= fclose(out) == 0;
+  if (!ok || rename(tmp_fn.c_str(), blob_fn.c_str()) != 0) {
+    unlink(tmp_fn.c_str());
+    return false;
+  }
+  return true;
+}
+
+const DBC* dbc_load_blob(const std::string& blob_fn) {
+  return map_blob(blob_fn, NULL);
+}
+
+const DBC* dbc_load(const std::string& dbc_name) {
+  if (dbc_name.empty() || dbc_name.find('/') != std::string::npos) return NULL;
+
+  std::string dbc_fn = dbc_dir() + "/" + dbc_name + ".dbc";
+  struct stat source;
+  if (stat(dbc_fn.c_str(), &source) != 0) return NULL;
+
+  std::string dir = cache_dir();
+  if (dir.empty()) return NULL;
+  std::string blob_fn = dir + "/" + dbc_name + ".bin";
+
+  const DBC* dbc = map_blob(blob_fn, &source);
+  if (dbc == NULL) {
+    if (!dbc_compile(dbc_fn, blob_fn)) {
+      WARN("failed to compile %s\n", dbc_fn.c_str());
+      return NULL;
+    }
+    dbc = map_blob(blob_fn, &source);
+  }
+  return dbc;
+}
@@ -6,11 +6,7 @@ namespace {
 const Signal sigs_{{address}}[] = {
   {% for sig in sigs %}
     {
-      {% if sig.is_little_endian %}
-        {% set b1 = sig.start_bit %}
-      {% else %}
-        {% set b1 = (sig.start_bit//8)*8  + (-sig.start_bit-1) % 8 %}
-      {% endif %}
+      {% set b1 = signal_b1(sig) %}
       .name = "{{sig.name}}",
       .b1 = {{b1}},
       .b2 = {{sig.size}},
@@ -19,32 +15,29 @@ const Signal sigs_{{address}}[] = {
       .factor = {{sig.factor}},
       .offset = {{sig.offset}},
       .is_little_endian = {{"true" if sig.is_little_endian else "false"}},
-      {% if checksum_type == "honda" and sig.name == "CHECKSUM" %}
-      .type = SignalType::HONDA_CHECKSUM,
-      {% elif checksum_type == "honda" and sig.name == "COUNTER" %}
-      .type = SignalType::HONDA_COUNTER,
-      {% elif checksum_type == "toyota" and sig.name == "CHECKSUM" %}
-      .type = SignalType::TOYOTA_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "CHECKSUM" %}
-      .type = SignalType::VOLKSWAGEN_CHECKSUM,
-      {% elif checksum_type == "volkswagen" and sig.name == "COUNTER" %}
-      .type = SignalType::VOLKSWAGEN_COUNTER,
-      {% elif checksum_type == "subaru" and sig.name == "CHECKSUM" %}
-      .type = SignalType::SUBARU_CHECKSUM,
-      {% elif checksum_type == "chrysler" and sig.name == "CHECKSUM" %}
-      .type = SignalType::CHRYSLER_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "CHECKSUM_PEDAL" %}
-      .type = SignalType::PEDAL_CHECKSUM,
-      {% elif address in [512, 513] and sig.name == "COUNTER_PEDAL" %}
-      .type = SignalType::PEDAL_COUNTER,
-      {% else %}
-      .type = SignalType::DEFAULT,
-      {% endif %}
+      .type = SignalType::{{signal_type(checksum_type, address, sig)}},
     },
   {% endfor %}
 };
 {% endfor %}
 
+{% if specialize %}
+{% for address, msg_name, msg_size, sigs in msgs %}
+void parse_{{address}}(uint64_t dat_le, uint64_t dat_be, double *vals) {
+  {% for sig in sigs %}
+  vals[{{loop.index0}}] = {{signal_value(sig)}};
+  {% endfor %}
+}
+{% set checksum = checksum_call(address, msg_size, sigs) %}
+{% if checksum %}
+
+bool checksum_{{address}}(uint64_t dat_le, uint64_t dat_be) {
+  return {{checksum}};
+}
+{% endif %}
+
+{% endfor %}
+{% endif %}
 const Msg msgs[] = {
 {% for address, msg_name, msg_size, sigs in msgs %}
   {% set address_hex = "0x%X" % address %}
@@ -54,6 +47,10 @@ const Msg msgs[] = {
     .size = {{msg_size}},
     .num_sigs = ARRAYSIZE(sigs_{{address}}),
     .sigs = sigs_{{address}},
+    {% if specialize %}
+    .parse = parse_{{address}},
+    .checksum = {{"checksum_%d" % address if checksum_call(address, msg_size, sigs) else "NULL"}},
+    {% endif %}
   },
 {% endfor %}
 };
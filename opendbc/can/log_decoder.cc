@@ -0,0 +1,208 @@
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <thread>
+
+#include <bzlib.h>
+
+#include "common.h"
+
+// Frames the parser history holds before it is drained into the columns
+static const size_t HISTORY_FRAMES = 1024;
+
+// Columns of one segment, the signals of a message are adjacent and in query_history order
+struct SegmentColumns {
+  std::unordered_map<uint32_t, size_t> first; // address -> index of its first signal
+  std::vector<SignalColumn> columns;
+};
+
+static void drain(CANParser &parser, std::vector<SignalHistory> &history, SegmentColumns &out) {
+  parser.query_history(history);
+
+  size_t msg_start = 0;
+  for (size_t i = 0; i < history.size(); i++) {
+    const SignalHistory &h = history[i];
+    if (i == 0 || h.address != history[i - 1].address) msg_start = i;
+
+    auto it = out.first.emplace(h.address, out.columns.size()).first;
+    size_t slot = it->second + (i - msg_start);
+    if (slot == out.columns.size()) {
+      out.columns.push_back({h.address, h.name, {}, {}});
+    }
+
+    SignalColumn &c = out.columns[slot];
+    c.ts.insert(c.ts.end(), h.ts, h.ts + h.count);
+    c.values.insert(c.values.end(), h.values, h.values + h.count);
+  }
+}
+
+// A corrupt or truncated segment is decoded up to its last complete event, and the error is returned in error
+static void decode_segment(const std::string &dbc_name, int bus, const kj::Array<capnp::word> &buf, SegmentColumns &out,
+                           std::string &error) {
+  CANParser parser(bus, dbc_name, false, false);
+  size_t history_size = HISTORY_FRAMES;
+  parser.set_history_size(history_size);
+  std::vector<SignalHistory> history;
+
+  // A message gets at most one value per frame, so the history can't wrap
+  // as long as it is drained before it has seen history_size frames
+  size_t pending = 0;
+
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = kj::maxValue;
+  kj::ArrayPtr<const capnp::word> words = buf.asPtr();
+  size_t num_events = 0;
+  try {
+    while (words.size() > 0) {
+      capnp::FlatArrayMessageReader reader(words, options);
+      words = kj::arrayPtr(reader.getEnd(), words.end());
+
+      cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+      num_events++;
+      if (event.which() != cereal::Event::CAN) continue;
+
+      // Check every frame first, so a corrupt event throws before any of it reaches the parser
+      auto cans = event.getCan();
+      for (auto c : cans) c.getDat();
+
+      if (pending + cans.size() > history_size) {
+        drain(parser, history, out);
+        pending = 0;
+        if (cans.size() > history_size) {
+          history_size = cans.size();
+          parser.set_history_size(history_size);
+        }
+      }
+      parser.UpdateCans(event.getLogMonoTime(), cans);
+      pending += cans.size();
+    }
+  } catch (const kj::Exception &e) {
+    error = "corrupt after event " + std::to_string(num_events) + ": " + e.getDescription().cStr();
+  }
+  drain(parser, history, out);
+}
+
+static void copy_aligned(const char *data, size_t size, kj::Array<capnp::word> &buf) {
+  buf = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+  memcpy(buf.begin(), data, buf.size() * sizeof(capnp::word));
+}
+
+static bool is_bz2(const char *data, size_t size) {
+  return size >= 3 && memcmp(data, "BZh", 3) == 0;
+}
+
+static std::string decompress_bz2(const char *data, size_t size, kj::Array<capnp::word> &buf) {
+  bz_stream strm = {};
+  if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK) return "can't decompress";
+
+  std::string out(std::max<size_t>(size * 4, 1 << 20), '\0');
+  size_t out_size = 0;
+  strm.next_in = (char *)data;
+  strm.avail_in = size;
+  int ret = BZ_OK;
+  while (ret == BZ_OK) {
+    if (out_size == out.size()) out.resize(out.size() * 2);
+    strm.next_out = &out[out_size];
+    strm.avail_out = out.size() - out_size;
+    ret = BZ2_bzDecompress(&strm);
+    out_size = out.size() - strm.avail_out;
+    // Out of input with room left for output, the stream was cut off
+    if (ret == BZ_OK && strm.avail_in == 0 && strm.avail_out > 0) break;
+  }
+  BZ2_bzDecompressEnd(&strm);
+  if (ret != BZ_STREAM_END) return "corrupt or truncated bz2 data";
+
+  copy_aligned(out.data(), out_size, buf);
+  return "";
+}
+
+std::string read_log(const std::string &path, kj::Array<capnp::word> &buf) {
+  std::ifstream f(path, std::ios::binary | std::ios::ate);
+  if (!f) return "can't read";
+  size_t size = f.tellg();
+  f.seekg(0);
+
+  char magic[3] = {};
+  if (size >= sizeof(magic) && f.read(magic, sizeof(magic)) && is_bz2(magic, sizeof(magic))) {
+    std::string data(size, '\0');
+    if (!f.seekg(0) || !f.read(&data[0], size)) return "can't read";
+    return decompress_bz2(data.data(), size, buf);
+  }
+
+  buf = kj::heapArray<capnp::word>(size / sizeof(capnp::word));
+  f.clear();
+  f.seekg(0);
+  f.read((char *)buf.begin(), buf.size() * sizeof(capnp::word));
+  return f ? "" : "can't read";
+}
+
+// Fills buf with the serialized events of segment i, the only copy of the segment. Returns what went wrong, or an empty string
+typedef std::function<std::string(size_t, kj::Array<capnp::word> &)> SegmentLoader;
+
+static std::vector<SignalColumn> decode(const std::string &dbc_name, int bus, size_t num_segments, int threads,
+                                        const SegmentLoader &load, std::vector<std::string> &errors) {
+  assert(dbc_lookup(dbc_name));
+
+  std::vector<SegmentColumns> segments(num_segments);
+  errors.assign(num_segments, "");
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    kj::Array<capnp::word> buf;
+    for (size_t i = next++; i < num_segments; i = next++) {
+      errors[i] = load(i, buf);
+      if (!errors[i].empty()) continue;
+      decode_segment(dbc_name, bus, buf, segments[i], errors[i]);
+    }
+  };
+
+  if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = std::min<size_t>(threads, std::max<size_t>(num_segments, 1));
+  std::vector<std::thread> workers;
+  for (int i = 1; i < threads; i++) workers.emplace_back(worker);
+  worker();
+  for (auto &t : workers) t.join();
+
+  // Concatenate in segment order. Signals are matched by their position in the message,
+  // some DBCs have more than one signal with the same name in a message
+  std::map<std::pair<uint32_t, size_t>, SignalColumn> merged;
+  for (auto &segment : segments) {
+    for (size_t i = 0; i < segment.columns.size(); i++) {
+      SignalColumn &c = segment.columns[i];
+      SignalColumn &m = merged[{c.address, i - segment.first[c.address]}];
+      if (m.name.empty()) {
+        m.address = c.address;
+        m.name = c.name;
+      }
+      m.ts.insert(m.ts.end(), c.ts.begin(), c.ts.end());
+      m.values.insert(m.values.end(), c.values.begin(), c.values.end());
+    }
+    segment = SegmentColumns();
+  }
+
+  std::vector<SignalColumn> ret;
+  ret.reserve(merged.size());
+  for (auto &[key, c] : merged) ret.push_back(std::move(c));
+  return ret;
+}
+
+std::vector<SignalColumn> decode_can_segments(const std::string &dbc_name, int bus,
+                                              const std::vector<std::string> &segments, int threads,
+                                              std::vector<std::string> &errors) {
+  return decode(dbc_name, bus, segments.size(), threads, [&](size_t i, kj::Array<capnp::word> &buf) -> std::string {
+    const std::string &segment = segments[i];
+    if (is_bz2(segment.data(), segment.size())) return decompress_bz2(segment.data(), segment.size(), buf);
+    copy_aligned(segment.data(), segment.size(), buf);
+    return "";
+  }, errors);
+}
+
+std::vector<SignalColumn> decode_can_files(const std::string &dbc_name, int bus,
+                                           const std::vector<std::string> &paths, int threads,
+                                           std::vector<std::string> &errors) {
+  return decode(dbc_name, bus, paths.size(), threads, [&](size_t i, kj::Array<capnp::word> &buf) {
+    return read_log(paths[i], buf);
+  }, errors);
+}
@@ -3,6 +3,9 @@
 #include <algorithm>
 #include <map>
 #include <cmath>
+#include <cstring>
+
+#include <time.h>
 
 #include "common.h"
 
@@ -20,61 +23,104 @@ uint64_t ReverseBytes(uint64_t x) {
           ((x & 0x00000000000000ffull) << 56);
 }
 
-static uint64_t set_value(uint64_t ret, const Signal& sig, int64_t ival) {
-  int shift = sig.is_little_endian? sig.b1 : sig.bo;
-  uint64_t mask = ((1ULL << sig.b2)-1) << shift;
-  uint64_t dat = (ival & ((1ULL << sig.b2)-1)) << shift;
-  if (sig.is_little_endian) {
+static inline uint64_t set_value(uint64_t ret, const PackSignal& sig, int64_t ival) {
+  uint64_t dat = ((uint64_t)ival & sig.value_mask) << sig.shift;
+  if (sig.little_endian) {
     dat = ReverseBytes(dat);
-    mask = ReverseBytes(mask);
   }
-  ret &= ~mask;
-  ret |= dat;
-  return ret;
+  return (ret & ~sig.mask) | dat;
+}
+
+static inline int64_t encode(const PackSignal& sig, double value) {
+  // Negative values wrap around to two's complement through value_mask
+  return (int64_t)(round((value - sig.offset) / sig.factor));
 }
 
 CANPacker::CANPacker(const std::string& dbc_name) {
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
 
+  plans.resize(dbc->num_msgs);
   for (int i=0; i<dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
-    message_lookup[msg->address] = *msg;
+    PackPlan &plan = plans[i];
+    plan.msg = msg;
+    plan.sigs.reserve(msg->num_sigs);
     for (int j=0; j<msg->num_sigs; j++) {
       const Signal* sig = &msg->sigs[j];
-      signal_lookup[std::make_pair(msg->address, std::string(sig->name))] = *sig;
+      PackSignal ps = {};
+      ps.shift = sig->is_little_endian ? sig->b1 : sig->bo;
+      ps.little_endian = sig->is_little_endian;
+      ps.value_mask = sig->b2 >= 64 ? ~0ULL : (1ULL << sig->b2) - 1;
+      ps.mask = ps.value_mask << ps.shift;
+      if (ps.little_endian) {
+        ps.mask = ReverseBytes(ps.mask);
+      }
+      ps.factor = sig->factor;
+      ps.offset = sig->offset;
+      ps.type = sig->type;
+      plan.sigs.push_back(ps);
+
+      plan.signal_index[sig->name] = j;
+      if (strcmp(sig->name, "COUNTER") == 0) {
+        plan.counter_sig = j;
+      } else if (strcmp(sig->name, "CHECKSUM") == 0) {
+        plan.checksum_sig = j;
+      }
     }
+    plan_index[msg->address] = i;
   }
-  init_crc_lookup_tables();
 }
 
 uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
+  const PackPlan *plan = lookup_plan(address);
+  if (plan == NULL) {
+    WARN("undefined message %d\n", address);
+    return 0;
+  }
+
   uint64_t ret = 0;
   for (const auto& sigval : signals) {
-    double value = sigval.value;
-
-    auto sig_it = signal_lookup.find(std::make_pair(address, sigval.name));
-    if (sig_it == signal_lookup.end()) {
+    auto it = plan->signal_index.find(sigval.name);
+    if (it == plan->signal_index.end()) {
       WARN("undefined signal %s - %d\n", sigval.name.c_str(), address);
       continue;
     }
-    const auto& sig = sig_it->second;
+    const PackSignal &sig = plan->sigs[it->second];
+    ret = set_value(ret, sig, encode(sig, sigval.value));
+  }
+  return set_counter_checksum(*plan, ret, counter);
+}
 
-    int64_t ival = (int64_t)(round((value - sig.offset) / sig.factor));
-    if (ival < 0) {
-      ival = (1ULL << sig.b2) + ival;
-    }
+uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackIndexValue> &signals, int counter) {
+  const PackPlan *plan = lookup_plan(address);
+  if (plan == NULL) {
+    WARN("undefined message %d\n", address);
+    return 0;
+  }
+  return pack(*plan, signals, counter);
+}
 
-    ret = set_value(ret, sig, ival);
+uint64_t CANPacker::pack(const PackPlan &plan, const std::vector<SignalPackIndexValue> &signals, int counter) {
+  uint64_t ret = 0;
+  for (const auto& sigval : signals) {
+    assert(sigval.index >= 0 && sigval.index < plan.sigs.size());
+    const PackSignal &sig = plan.sigs[sigval.index];
+    ret = set_value(ret, sig, encode(sig, sigval.value));
   }
+  return set_counter_checksum(plan, ret, counter);
+}
+
+uint64_t CANPacker::set_counter_checksum(const PackPlan &plan, uint64_t ret, int counter) {
+  uint32_t address = plan.msg->address;
+  int size = plan.msg->size;
 
   if (counter >= 0){
-    auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
-    if (sig_it == signal_lookup.end()) {
+    if (plan.counter_sig < 0) {
       WARN("COUNTER not defined\n");
       return ret;
     }
-    const auto& sig = sig_it->second;
+    const auto& sig = plan.sigs[plan.counter_sig];
 
     if ((sig.type != SignalType::HONDA_COUNTER) && (sig.type != SignalType::VOLKSWAGEN_COUNTER)) {
       WARN("COUNTER signal type not valid\n");
@@ -83,26 +129,25 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
     ret = set_value(ret, sig, counter);
   }
 
-  auto sig_it_checksum = signal_lookup.find(std::make_pair(address, "CHECKSUM"));
-  if (sig_it_checksum != signal_lookup.end()) {
-    const auto& sig = sig_it_checksum->second;
+  if (plan.checksum_sig >= 0) {
+    const auto& sig = plan.sigs[plan.checksum_sig];
     if (sig.type == SignalType::HONDA_CHECKSUM) {
-      unsigned int chksm = honda_checksum(address, ret, message_lookup[address].size);
+      unsigned int chksm = honda_checksum(address, ret, size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-      unsigned int chksm = toyota_checksum(address, ret, message_lookup[address].size);
+      unsigned int chksm = toyota_checksum(address, ret, size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
       // FIXME: Hackish fix for an endianness issue. The message is in reverse byte order
       // until later in the pack process. Checksums can be run backwards, CRCs not so much.
       // The correct fix is unclear but this works for the moment.
-      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), message_lookup[address].size);
+      unsigned int chksm = volkswagen_crc(address, ReverseBytes(ret), size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-      unsigned int chksm = subaru_checksum(address, ret, message_lookup[address].size);
+      unsigned int chksm = subaru_checksum(address, ret, size);
       ret = set_value(ret, sig, chksm);
     } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), message_lookup[address].size);
+      unsigned int chksm = chrysler_checksum(address, ReverseBytes(ret), size);
       ret = set_value(ret, sig, chksm);
     } else {
       //WARN("CHECKSUM signal type not valid\n");
@@ -112,6 +157,64 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
   return ret;
 }
 
-Msg* CANPacker::lookup_message(uint32_t address) {
-  return &message_lookup[address];
+int CANPacker::signal_index(uint32_t address, const std::string &name) {
+  const PackPlan *plan = lookup_plan(address);
+  if (plan == NULL) return -1;
+
+  auto it = plan->signal_index.find(name);
+  return it == plan->signal_index.end() ? -1 : it->second;
+}
+
+const PackPlan* CANPacker::lookup_plan(uint32_t address) {
+  auto it = plan_index.find(address);
+  return it == plan_index.end() ? NULL : &plans[it->second];
+}
+
+const Msg* CANPacker::lookup_message(uint32_t address) {
+  const PackPlan *plan = lookup_plan(address);
+  return plan == NULL ? NULL : plan->msg;
+}
+
+#ifndef DYNAMIC_CAPNP
+void CANPacker::pack_sendcan(const std::vector<CanPackRequest> &requests, cereal::Event::Builder event) {
+  // A message the DBC doesn't have would go on the bus without data
+  size_t num_frames = 0;
+  for (const auto &req : requests) {
+    if (lookup_plan(req.address) != NULL) {
+      num_frames++;
+    } else {
+      WARN("undefined message %d, not sending it\n", req.address);
+    }
+  }
+
+  auto frames = event.initSendcan(num_frames);
+  size_t i = 0;
+  for (const auto &req : requests) {
+    const PackPlan *plan = lookup_plan(req.address);
+    if (plan == NULL) continue;
+    uint64_t dat = ReverseBytes(pack(*plan, req.values, req.counter));
+
+    auto frame = frames[i++];
+    frame.setAddress(req.address);
+    frame.setBusTime(0);
+    frame.setDat(kj::arrayPtr((const uint8_t *)&dat, plan->msg->size));
+    frame.setSrc(req.bus);
+  }
+}
+
+void CANPacker::pack_sendcan(const std::vector<CanPackRequest> &requests, bool valid, std::string &out) {
+  struct timespec t;
+  clock_gettime(CLOCK_BOOTTIME, &t);
+
+  capnp::MallocMessageBuilder msg;
+  auto event = msg.initRoot<cereal::Event>();
+  event.setLogMonoTime(t.tv_sec * 1000000000ULL + t.tv_nsec);
+  event.setValid(valid);
+  pack_sendcan(requests, event);
+
+  const uint64_t msg_size = capnp::computeSerializedSizeInWords(msg) * sizeof(capnp::word);
+  out.resize(msg_size);
+  kj::ArrayOutputStream output_stream(kj::ArrayPtr<capnp::byte>((unsigned char *)out.data(), msg_size));
+  capnp::writeMessage(output_stream, msg);
 }
+#endif
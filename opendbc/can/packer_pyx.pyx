@@ -9,7 +9,7 @@ from libcpp cimport bool
 from posix.dlfcn cimport dlopen, dlsym, RTLD_LAZY
 
 from .common cimport CANPacker as cpp_CANPacker
-from .common cimport dbc_lookup, SignalPackValue, DBC
+from .common cimport dbc_lookup, SignalPackIndexValue, CanPackRequest, DBC
 
 
 cdef class CANPacker:
@@ -18,6 +18,7 @@ cdef class CANPacker:
     const DBC *dbc
     map[string, (int, int)] name_to_address_and_size
     map[int, int] address_to_size
+    dict signal_indexes
 
   def __init__(self, dbc_name):
     self.dbc = dbc_lookup(dbc_name)
@@ -25,23 +26,33 @@ cdef class CANPacker:
       raise RuntimeError(f"Can't lookup {dbc_name}")
 
     self.packer = new cpp_CANPacker(dbc_name)
+    self.signal_indexes = {}
     num_msgs = self.dbc[0].num_msgs
     for i in range(num_msgs):
       msg = self.dbc[0].msgs[i]
       self.name_to_address_and_size[string(msg.name)] = (msg.address, msg.size)
       self.address_to_size[msg.address] = msg.size
+      # Signal names resolved once, pack only gets the indexes
+      self.signal_indexes[msg.address] = {msg.sigs[j].name.decode('utf8'): j for j in range(msg.num_sigs)}
 
-  cdef uint64_t pack(self, addr, values, counter):
-    cdef vector[SignalPackValue] values_thing
+  cdef vector[SignalPackIndexValue] pack_values(self, addr, values):
+    cdef vector[SignalPackIndexValue] values_thing
     values_thing.reserve(len(values))
-    cdef SignalPackValue spv
+    cdef SignalPackIndexValue spv
 
-    for name, value in values.iteritems():
-      spv.name = name.encode('utf8')
+    indexes = self.signal_indexes.get(addr, {})
+    for name, value in values.items():
+      idx = indexes.get(name)
+      if idx is None:
+        print(f"undefined signal {name} - {addr}")
+        continue
+      spv.index = idx
       spv.value = value
       values_thing.push_back(spv)
+    return values_thing
 
-    return self.packer.pack(addr, values_thing, counter)
+  cdef uint64_t pack(self, addr, values, counter):
+    return self.packer.pack(<uint32_t>addr, self.pack_values(addr, values), <int>counter)
 
   cdef inline uint64_t ReverseBytes(self, uint64_t x):
     return (((x & 0xff00000000000000ull) >> 56) |
@@ -53,6 +64,12 @@ cdef class CANPacker:
            ((x & 0x000000000000ff00ull) << 40) |
            ((x & 0x00000000000000ffull) << 56))
 
+  cdef int lookup_address(self, name_or_addr):
+    if type(name_or_addr) == int:
+      return name_or_addr
+    addr, _ = self.name_to_address_and_size[name_or_addr.encode('utf8')]
+    return addr
+
   cpdef make_can_msg(self, name_or_addr, bus, values, counter=-1):
     cdef int addr, size
     if type(name_or_addr) == int:
@@ -63,3 +80,20 @@ cdef class CANPacker:
     cdef uint64_t val = self.pack(addr, values, counter)
     val = self.ReverseBytes(val)
     return [addr, 0, (<char *>&val)[:size], bus]
+
+  cpdef make_sendcan(self, msgs, valid=True):
+    """Packs [name_or_addr, bus, values, counter] entries into a serialized sendcan event"""
+    cdef vector[CanPackRequest] requests
+    requests.reserve(len(msgs))
+    cdef CanPackRequest req
+
+    for name_or_addr, bus, values, counter in msgs:
+      req.address = self.lookup_address(name_or_addr)
+      req.bus = bus
+      req.values = self.pack_values(req.address, values)
+      req.counter = counter
+      requests.push_back(req)
+
+    cdef string out
+    self.packer.pack_sendcan(requests, valid, out)
+    return out
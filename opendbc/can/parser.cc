@@ -13,83 +13,157 @@
 // #define DEBUG printf
 #define INFO printf
 
-bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
-  uint64_t dat_le = read_u64_le(dat);
-  uint64_t dat_be = read_u64_be(dat);
-
-  for (int i=0; i < parse_sigs.size(); i++) {
-    auto& sig = parse_sigs[i];
-    int64_t tmp;
+// 11-bit standard ids are looked up directly, extended ids by binary search
+#define DIRECT_INDEX_SIZE 0x800
+
+size_t SignalTable::add(const Signal &sig, uint16_t index, double default_value) {
+  names.push_back(sig.name);
+  shifts.push_back(sig.is_little_endian ? sig.b1 : sig.bo);
+  little_endian.push_back(sig.is_little_endian);
+  masks.push_back(sig.b2 >= 64 ? ~0ULL : (1ULL << sig.b2) - 1);
+  sign_bits.push_back(sig.is_signed ? 1ULL << (sig.b2 - 1) : 0);
+  factors.push_back(sig.factor);
+  offsets.push_back(sig.offset);
+  types.push_back(sig.type);
+  dbc_index.push_back(index);
+  vals.push_back(default_value);
+  return names.size() - 1;
+}
 
-    if (sig.is_little_endian){
-      tmp = (dat_le >> sig.b1) & ((1ULL << sig.b2)-1);
-    } else {
-      tmp = (dat_be >> sig.bo) & ((1ULL << sig.b2)-1);
+static bool verify_checksum(SignalType type, uint32_t address, uint64_t dat_le, uint64_t dat_be, int size, int64_t checksum) {
+  if (type == SignalType::HONDA_CHECKSUM) {
+    if (honda_checksum(address, dat_be, size) != checksum) {
+      INFO("0x%X CHECKSUM FAIL\n", address);
+      return false;
     }
-
-    if (sig.is_signed) {
-      tmp -= (tmp >> (sig.b2-1)) ? (1ULL << sig.b2) : 0; //signed
+  } else if (type == SignalType::TOYOTA_CHECKSUM) {
+    if (toyota_checksum(address, dat_be, size) != checksum) {
+      INFO("0x%X CHECKSUM FAIL\n", address);
+      return false;
+    }
+  } else if (type == SignalType::VOLKSWAGEN_CHECKSUM) {
+    if (volkswagen_crc(address, dat_le, size) != checksum) {
+      INFO("0x%X CRC FAIL\n", address);
+      return false;
+    }
+  } else if (type == SignalType::SUBARU_CHECKSUM) {
+    if (subaru_checksum(address, dat_be, size) != checksum) {
+      INFO("0x%X CHECKSUM FAIL\n", address);
+      return false;
+    }
+  } else if (type == SignalType::CHRYSLER_CHECKSUM) {
+    if (chrysler_checksum(address, dat_le, size) != checksum) {
+      INFO("0x%X CHECKSUM FAIL\n", address);
+      return false;
     }
+  } else if (type == SignalType::PEDAL_CHECKSUM) {
+    if (pedal_checksum(dat_be, size) != checksum) {
+      INFO("0x%X PEDAL CHECKSUM FAIL\n", address);
+      return false;
+    }
+  }
+  return true;
+}
 
-    DEBUG("parse 0x%X %s -> %lld\n", address, sig.name, tmp);
+void MessageState::init(const Msg *msg, SignalTable &signals) {
+  address = msg->address;
+  size = msg->size;
+  sig_start = signals.names.size();
+  parse_fn = msg->parse;
+  checksum_fn = msg->checksum;
+  if (signals.scratch.size() < msg->num_sigs) {
+    signals.scratch.resize(msg->num_sigs);
+  }
+}
 
-    if (!ignore_checksum) {
-      if (sig.type == SignalType::HONDA_CHECKSUM) {
-        if (honda_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::TOYOTA_CHECKSUM) {
-        if (toyota_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::VOLKSWAGEN_CHECKSUM) {
-        if (volkswagen_crc(address, dat_le, size) != tmp) {
-          INFO("0x%X CRC FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::SUBARU_CHECKSUM) {
-        if (subaru_checksum(address, dat_be, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::CHRYSLER_CHECKSUM) {
-        if (chrysler_checksum(address, dat_le, size) != tmp) {
-          INFO("0x%X CHECKSUM FAIL\n", address);
-          return false;
-        }
-      } else if (sig.type == SignalType::PEDAL_CHECKSUM) {
-        if (pedal_checksum(dat_be, size) != tmp) {
-          INFO("0x%X PEDAL CHECKSUM FAIL\n", address);
-          return false;
-        }
+void MessageState::add_signal(SignalTable &signals, const Msg *msg, int index, double default_value) {
+  const Signal &sig = msg->sigs[index];
+  size_t idx = signals.add(sig, index, default_value);
+  assert(idx == sig_start + num_sigs); // The signals of a message have to be added together
+  num_sigs++;
+
+  parse_in_place = msg->parse != NULL && num_sigs == msg->num_sigs;
+  for (size_t i = 0; parse_in_place && i < num_sigs; i++) {
+    parse_in_place = signals.dbc_index[sig_start + i] == i;
+  }
+
+  switch (sig.type) {
+    case SignalType::HONDA_CHECKSUM:
+    case SignalType::TOYOTA_CHECKSUM:
+    case SignalType::PEDAL_CHECKSUM:
+    case SignalType::VOLKSWAGEN_CHECKSUM:
+    case SignalType::SUBARU_CHECKSUM:
+    case SignalType::CHRYSLER_CHECKSUM:
+      checksum_sig = idx;
+      break;
+    case SignalType::HONDA_COUNTER:
+    case SignalType::VOLKSWAGEN_COUNTER:
+    case SignalType::PEDAL_COUNTER:
+      counter_sig = idx;
+      break;
+    default:
+      break;
+  }
+}
+
+bool MessageState::parse(uint64_t sec, uint16_t ts_, const uint8_t * dat, SignalTable &signals) {
+  uint64_t dat_le = read_u64_le(dat);
+  uint64_t dat_be = read_u64_be(dat);
+
+  // Checksum and counter are verified before any value is updated
+  if (checksum_sig >= 0 && !ignore_checksum) {
+    if (checksum_fn != NULL) {
+      if (!checksum_fn(dat_le, dat_be)) {
+        INFO("0x%X CHECKSUM FAIL\n", address);
+        return false;
       }
-    }
-    if (!ignore_counter) {
-      if (sig.type == SignalType::HONDA_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      } else if (sig.type == SignalType::VOLKSWAGEN_COUNTER) {
-          if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
-      } else if (sig.type == SignalType::PEDAL_COUNTER) {
-        if (!update_counter_generic(tmp, sig.b2)) {
-          return false;
-        }
+    } else {
+      int64_t checksum = signals.extract(checksum_sig, dat_le, dat_be);
+      if (!verify_checksum(signals.types[checksum_sig], address, dat_le, dat_be, size, checksum)) {
+        return false;
       }
     }
+  }
+  if (counter_sig >= 0 && !ignore_counter) {
+    int64_t v = signals.extract(counter_sig, dat_le, dat_be);
+    if (!update_counter_generic(v, __builtin_popcountll(signals.masks[counter_sig]))) {
+      return false;
+    }
+  }
 
-    vals[i] = tmp * sig.factor + sig.offset;
+  if (parse_in_place) {
+    parse_fn(dat_le, dat_be, &signals.vals[sig_start]);
+  } else if (parse_fn != NULL) {
+    parse_fn(dat_le, dat_be, signals.scratch.data());
+    for (size_t i = sig_start; i < sig_start + num_sigs; i++) {
+      signals.vals[i] = signals.scratch[signals.dbc_index[i]];
+    }
+  } else {
+    for (size_t i = sig_start; i < sig_start + num_sigs; i++) {
+      signals.vals[i] = signals.extract(i, dat_le, dat_be) * signals.factors[i] + signals.offsets[i];
+    }
   }
   ts = ts_;
   seen = sec;
 
+  if (signals.history_size > 0) {
+    append_history(sec, signals);
+  }
+
   return true;
 }
 
+void MessageState::append_history(uint64_t sec, SignalTable &signals) {
+  // Overwrites the oldest values when the consumer falls behind
+  size_t size = signals.history_size;
+  history_ts[history_next] = sec;
+  for (size_t i = sig_start; i < sig_start + num_sigs; i++) {
+    signals.history[i * size + history_next] = signals.vals[i];
+  }
+  history_next = (history_next + 1) % size;
+  history_count = std::min(history_count + 1, size);
+}
+
 
 bool MessageState::update_counter_generic(int64_t v, int cnt_size) {
   uint8_t old_counter = counter;
@@ -116,10 +190,9 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
 
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
-  init_crc_lookup_tables();
 
   for (const auto& op : options) {
-    MessageState &state = message_states[op.address];
+    MessageState state;
     state.address = op.address;
     // state.check_frequency = op.check_frequency,
 
@@ -140,14 +213,13 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
       assert(false);
     }
 
-    state.size = msg->size;
+    state.init(msg, signals);
 
     // track checksums and counters for this message
     for (int i = 0; i < msg->num_sigs; i++) {
       const Signal *sig = &msg->sigs[i];
       if (sig->type != SignalType::DEFAULT) {
-        state.parse_sigs.push_back(*sig);
-        state.vals.push_back(0);
+        state.add_signal(signals, msg, i, 0);
       }
     }
 
@@ -159,13 +231,16 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
         const Signal *sig = &msg->sigs[i];
         if (strcmp(sig->name, sigop.name) == 0
             && sig->type == SignalType::DEFAULT) {
-          state.parse_sigs.push_back(*sig);
-          state.vals.push_back(sigop.default_value);
+          state.add_signal(signals, msg, i, sigop.default_value);
           break;
         }
       }
     }
+
+    message_states.push_back(state);
   }
+
+  init_index();
 }
 
 CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum, bool ignore_counter)
@@ -174,24 +249,48 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
 
   dbc = dbc_lookup(dbc_name);
   assert(dbc);
-  init_crc_lookup_tables();
 
   for (int i = 0; i < dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
-    MessageState state = {
-      .address = msg->address,
-      .size = msg->size,
-      .ignore_checksum = ignore_checksum,
-      .ignore_counter = ignore_counter,
-    };
+    MessageState state;
+    state.init(msg, signals);
+    state.ignore_checksum = ignore_checksum;
+    state.ignore_counter = ignore_counter;
 
     for (int j = 0; j < msg->num_sigs; j++) {
-      const Signal *sig = &msg->sigs[j];
-      state.parse_sigs.push_back(*sig);
-      state.vals.push_back(0);
+      state.add_signal(signals, msg, j, 0);
     }
 
-    message_states[state.address] = state;
+    message_states.push_back(state);
+  }
+
+  init_index();
+}
+
+void CANParser::init_index() {
+  std::sort(message_states.begin(), message_states.end(), [](const MessageState &a, const MessageState &b) {
+    return a.address < b.address;
+  });
+
+  direct_index.assign(DIRECT_INDEX_SIZE, -1);
+  extended_index.clear();
+  for (size_t i = 0; i < message_states.size(); i++) {
+    uint32_t address = message_states[i].address;
+    assert(i == 0 || message_states[i - 1].address != address);
+    if (address < DIRECT_INDEX_SIZE) {
+      direct_index[address] = i;
+    } else {
+      extended_index.push_back({address, (int16_t)i});
+    }
+  }
+
+  deadlines = {};
+  expired.clear();
+  for (size_t i = 0; i < message_states.size(); i++) {
+    const MessageState &state = message_states[i];
+    if (state.check_threshold > 0) {
+      deadlines.push({state.seen + state.check_threshold, i});
+    }
   }
 }
 
@@ -228,18 +327,23 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
       // DEBUG("skip %d: wrong bus\n", cmsg.getAddress());
       continue;
     }
-    auto state_it = message_states.find(cmsg.getAddress());
-    if (state_it == message_states.end()) {
-      // DEBUG("skip %d: not specified\n", cmsg.getAddress());
-      continue;
-    }
-
-    if (cmsg.getDat().size() > 8) continue; //shouldn't ever happen
-    uint8_t dat[8] = {0};
-    memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
+    UpdateCan(sec, cmsg);
+  }
+}
 
-    state_it->second.parse(sec, cmsg.getBusTime(), dat);
+void CANParser::UpdateCan(uint64_t sec, const cereal::CanData::Reader& cmsg) {
+  MessageState *state = lookup(cmsg.getAddress());
+  if (state == nullptr) {
+    // DEBUG("skip %d: not specified\n", cmsg.getAddress());
+    return;
   }
+
+  auto dat = cmsg.getDat();
+  if (dat.size() > 8) return; //shouldn't ever happen
+  uint8_t data[8] = {0};
+  memcpy(data, dat.begin(), dat.size());
+
+  state->parse(sec, cmsg.getBusTime(), data, signals);
 }
 #endif
 
@@ -252,8 +356,8 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
     return;
   }
 
-  auto state_it = message_states.find(cmsg.get("address").as<uint32_t>());
-  if (state_it == message_states.end()) {
+  MessageState *state = lookup(cmsg.get("address").as<uint32_t>());
+  if (state == nullptr) {
     DEBUG("skip %d: not specified\n", cmsg.get("address").as<uint32_t>());
     return;
   }
@@ -262,41 +366,161 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
   if (dat.size() > 8) return; //shouldn't ever happen
   uint8_t data[8] = {0};
   memcpy(data, dat.begin(), dat.size());
-  state_it->second.parse(sec, cmsg.get("busTime").as<uint16_t>(), data);
+  state->parse(sec, cmsg.get("busTime").as<uint16_t>(), data, signals);
 }
 
 void CANParser::UpdateValid(uint64_t sec) {
-  can_valid = true;
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
-    if (state.check_threshold > 0 && (sec - state.seen) > state.check_threshold) {
-      if (state.seen > 0) {
-        DEBUG("0x%X TIMEOUT\n", state.address);
-      } else {
-        DEBUG("0x%X MISSING\n", state.address);
-      }
-      can_valid = false;
+  // Only the messages past their deadline are looked at, not every tracked message
+  bool changed = false;
+  for (size_t i = 0; i < expired.size();) {
+    const MessageState &state = message_states[expired[i]];
+    if (sec - state.seen <= state.check_threshold) {
+      deadlines.push({state.seen + state.check_threshold, expired[i]});
+      expired[i] = expired.back();
+      expired.pop_back();
+      changed = true;
+    } else {
+      i++;
+    }
+  }
+
+  while (!deadlines.empty() && deadlines.top().first < sec) {
+    int idx = deadlines.top().second;
+    deadlines.pop();
+
+    const MessageState &state = message_states[idx];
+    if (sec - state.seen <= state.check_threshold) {
+      deadlines.push({state.seen + state.check_threshold, idx});
+      continue;
+    }
+
+    if (state.seen > 0) {
+      DEBUG("0x%X TIMEOUT\n", state.address);
+    } else {
+      DEBUG("0x%X MISSING\n", state.address);
+    }
+    expired.push_back(idx);
+    changed = true;
+  }
+
+  if (changed) {
+    // message_states is sorted by address
+    std::sort(expired.begin(), expired.end());
+    timed_out.clear();
+    for (int idx : expired) {
+      timed_out.push_back(message_states[idx].address);
     }
   }
+  can_valid = expired.empty();
 }
 
 std::vector<SignalValue> CANParser::query_latest() {
   std::vector<SignalValue> ret;
 
-  for (const auto& kv : message_states) {
-    const auto& state = kv.second;
+  for (const auto& state : message_states) {
     if (last_sec != 0 && state.seen != last_sec) continue;
 
-    for (int i=0; i<state.parse_sigs.size(); i++) {
-      const Signal &sig = state.parse_sigs[i];
+    for (size_t i = state.sig_start; i < state.sig_start + state.num_sigs; i++) {
       ret.push_back((SignalValue){
         .address = state.address,
         .ts = state.ts,
-        .name = sig.name,
-        .value = state.vals[i],
+        .name = signals.names[i],
+        .value = signals.vals[i],
       });
     }
   }
 
   return ret;
 }
+
+void CANParser::set_history_size(size_t size) {
+  signals.history_size = size;
+  signals.history.assign(signals.names.size() * size, 0);
+  for (auto& state : message_states) {
+    state.history_ts.assign(size, 0);
+    state.history_count = 0;
+    state.history_next = 0;
+  }
+}
+
+void CANParser::query_history(std::vector<SignalHistory> &out) {
+  out.clear();
+
+  size_t size = signals.history_size;
+  for (auto& state : message_states) {
+    if (state.history_count == 0) continue;
+
+    // The buffer only wraps if more than size values came in, rotate it so the oldest value is first
+    if (state.history_count == size && state.history_next != 0) {
+      std::rotate(state.history_ts.begin(), state.history_ts.begin() + state.history_next, state.history_ts.end());
+      for (size_t i = state.sig_start; i < state.sig_start + state.num_sigs; i++) {
+        double *values = &signals.history[i * size];
+        std::rotate(values, values + state.history_next, values + size);
+      }
+    }
+
+    for (size_t i = state.sig_start; i < state.sig_start + state.num_sigs; i++) {
+      out.push_back((SignalHistory){
+        .address = state.address,
+        .name = signals.names[i],
+        .count = state.history_count,
+        .ts = state.history_ts.data(),
+        .values = &signals.history[i * size],
+      });
+    }
+
+    // The data stays in place until the next update overwrites it
+    state.history_count = 0;
+    state.history_next = 0;
+  }
+}
+
+CANParserGroup::CANParserGroup(const std::vector<CANParser*> &aparsers) : parsers(aparsers), bus_parsers(256) {
+  for (CANParser *p : parsers) {
+    assert(p->get_bus() >= 0 && p->get_bus() < (int)bus_parsers.size());
+    bus_parsers[p->get_bus()].push_back(p);
+  }
+}
+
+#ifndef DYNAMIC_CAPNP
+void CANParserGroup::update_string(const std::string &data, bool sendcan) {
+  // one aligned copy and capnp read for all the parsers
+  const size_t buf_size = (data.length() / sizeof(capnp::word)) + 1;
+  if (aligned_buf.size() < buf_size) {
+    aligned_buf = kj::heapArray<capnp::word>(buf_size);
+  }
+  memcpy(aligned_buf.begin(), data.data(), data.length());
+
+  capnp::FlatArrayMessageReader cmsg(aligned_buf.slice(0, buf_size));
+  cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+
+  last_sec = event.getLogMonoTime();
+  for (CANParser *p : parsers) p->last_sec = last_sec;
+
+  auto cans = sendcan? event.getSendcan() : event.getCan();
+  UpdateCans(last_sec, cans);
+
+  UpdateValid(last_sec);
+}
+
+void CANParserGroup::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Reader& cans) {
+  int msg_count = cans.size();
+  for (int i = 0; i < msg_count; i++) {
+    auto cmsg = cans[i];
+    for (CANParser *p : bus_parsers[cmsg.getSrc() & 0xFF]) {
+      p->UpdateCan(sec, cmsg);
+    }
+  }
+}
+#endif
+
+void CANParserGroup::UpdateValid(uint64_t sec) {
+  for (CANParser *p : parsers) p->UpdateValid(sec);
+}
+
+bool CANParserGroup::can_valid() const {
+  for (CANParser *p : parsers) {
+    if (!p->can_valid) return false;
+  }
+  return true;
+}
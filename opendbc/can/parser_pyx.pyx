@@ -9,10 +9,13 @@ from libcpp.map cimport map
 from libcpp cimport bool
 
 from .common cimport CANParser as cpp_CANParser
-from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, DBC
+from .common cimport CANParserGroup as cpp_CANParserGroup
+from .common cimport SignalColumn, decode_can_segments, decode_can_files
+from .common cimport SignalParseOptions, MessageParseOptions, dbc_lookup, SignalValue, SignalHistory, DBC
 
 import os
 import numbers
+import numpy as np
 from collections import defaultdict
 
 cdef int CAN_INVALID_CNT = 5
@@ -24,25 +27,32 @@ cdef class CANParser:
     map[string, uint32_t] msg_name_to_address
     map[uint32_t, string] address_to_msg_name
     vector[SignalValue] can_values
+    vector[SignalHistory] can_history
     bool test_mode_enabled
 
   cdef readonly:
     string dbc_name
     dict vl
     dict ts
+    dict vl_all
+    dict ts_all
     bool can_valid
     int can_invalid_cnt
+    list timed_out
 
-  def __init__(self, dbc_name, signals, checks=None, bus=0, enforce_checks=True):
+  def __init__(self, dbc_name, signals, checks=None, bus=0, enforce_checks=True, history_size=0):
     if checks is None:
       checks = []
     self.can_valid = True
+    self.timed_out = []
     self.dbc_name = dbc_name
     self.dbc = dbc_lookup(dbc_name)
     if not self.dbc:
       raise RuntimeError(f"Can't find DBC: {dbc_name}")
     self.vl = {}
     self.ts = {}
+    self.vl_all = {}
+    self.ts_all = {}
 
     self.can_invalid_cnt = CAN_INVALID_CNT
 
@@ -101,6 +111,8 @@ cdef class CANParser:
       message_options_v.push_back(mpo)
 
     self.can = new cpp_CANParser(bus, dbc_name, message_options_v, signal_options_v)
+    if history_size > 0:
+      self.can.set_history_size(history_size)
     self.update_vl()
 
   cdef unordered_set[uint32_t] update_vl(self):
@@ -115,6 +127,7 @@ cdef class CANParser:
     if valid:
         self.can_invalid_cnt = 0
     self.can_valid = self.can_invalid_cnt < CAN_INVALID_CNT
+    self.timed_out = self.can.timed_out
 
     for cv in can_values:
       # Cast char * directly to unicode
@@ -131,19 +144,127 @@ cdef class CANParser:
 
     return updated_val
 
+  cdef void update_vl_all(self):
+    # vl_all and ts_all hold every value since the previous update as numpy arrays.
+    # They are views into the parser's buffers, copy them to keep them past the next update
+    cdef SignalHistory h
+
+    self.vl_all.clear()
+    self.ts_all.clear()
+    self.can.query_history(self.can_history)
+
+    for h in self.can_history:
+      name = <unicode>self.address_to_msg_name[h.address].c_str()
+      sig_name = <unicode>h.name
+      values = np.asarray(<double[:h.count]> <double *>h.values)
+      ts = np.asarray(<uint64_t[:h.count]> <uint64_t *>h.ts)
+
+      self.vl_all.setdefault(h.address, {})[sig_name] = values
+      self.ts_all.setdefault(h.address, {})[sig_name] = ts
+      self.vl_all.setdefault(name, {})[sig_name] = values
+      self.ts_all.setdefault(name, {})[sig_name] = ts
+
   def update_string(self, dat, sendcan=False):
     self.can.update_string(dat, sendcan)
-    return self.update_vl()
+    updated_val = self.update_vl()
+    self.update_vl_all()
+    return updated_val
 
   def update_strings(self, strings, sendcan=False):
     updated_vals = set()
 
     for s in strings:
-      updated_val = self.update_string(s, sendcan)
-      updated_vals.update(updated_val)
+      self.can.update_string(s, sendcan)
+      updated_vals.update(self.update_vl())
 
+    self.update_vl_all()
     return updated_vals
 
+cdef class CANParserGroup:
+  # Updates several CANParsers, one per bus, from a single pass over each can packet.
+  # The parsers stay usable as they are, with their own vl, ts and can_valid.
+  cdef:
+    cpp_CANParserGroup *group
+
+  cdef readonly:
+    list parsers
+    bool can_valid
+    list log_mono_times  # logMonoTime of each string of the last update_strings
+
+  def __init__(self, parsers):
+    cdef vector[cpp_CANParser*] parsers_v
+    cdef CANParser p
+
+    self.parsers = list(parsers)
+    for p in self.parsers:
+      parsers_v.push_back(p.can)
+    self.group = new cpp_CANParserGroup(parsers_v)
+    self.can_valid = all(p.can_valid for p in self.parsers)
+    self.log_mono_times = []
+
+  def __dealloc__(self):
+    del self.group
+
+  def update_strings(self, strings, sendcan=False):
+    # Returns the updated addresses of each parser, in the order of parsers
+    cdef CANParser p
+    updated_vals = [set() for _ in self.parsers]
+    self.log_mono_times = []
+
+    for s in strings:
+      self.group.update_string(s, sendcan)
+      self.log_mono_times.append(self.group.last_sec)
+      for i, p in enumerate(self.parsers):
+        updated_vals[i].update(p.update_vl())
+
+    for p in self.parsers:
+      p.update_vl_all()
+    self.can_valid = all(p.can_valid for p in self.parsers)
+    return updated_vals
+
+def decode_can_logs(dbc_name, logs, bus=0, threads=0):
+  # Decodes all the messages of the DBC in whole logs in one call, one thread per log up to threads (0 for all cores).
+  # logs are the paths of rlogs or their contents as bytes, bz2 compressed or not. Returns vl_all and ts_all like
+  # CANParser, numpy arrays with every value in log order, keyed by address and message name, and
+  # errors, the index of each unreadable or corrupt log to its error. Corrupt logs are decoded up to the corruption
+  cdef const DBC *dbc = dbc_lookup(dbc_name)
+  if not dbc:
+    raise RuntimeError(f"Can't find DBC: {dbc_name}")
+
+  cdef string dbc_name_s = dbc_name
+  cdef vector[string] logs_v = logs
+  cdef bool from_files = all(isinstance(l, str) for l in logs)
+  cdef int bus_i = bus
+  cdef int threads_i = threads
+  cdef vector[SignalColumn] columns
+  cdef vector[string] errors_v
+  with nogil:
+    if from_files:
+      columns = decode_can_files(dbc_name_s, bus_i, logs_v, threads_i, errors_v)
+    else:
+      columns = decode_can_segments(dbc_name_s, bus_i, logs_v, threads_i, errors_v)
+
+  errors = {i: e.decode('utf8') for i, e in enumerate(errors_v) if e}
+
+  address_to_msg_name = {}
+  for i in range(dbc[0].num_msgs):
+    address_to_msg_name[dbc[0].msgs[i].address] = dbc[0].msgs[i].name.decode('utf8')
+
+  vl_all, ts_all = {}, {}
+  cdef size_t j
+  for j in range(columns.size()):
+    address = columns[j].address
+    name = address_to_msg_name[address]
+    sig_name = <unicode>columns[j].name
+    values = np.asarray(<double[:columns[j].values.size()]> columns[j].values.data()).copy()
+    ts = np.asarray(<uint64_t[:columns[j].ts.size()]> columns[j].ts.data()).copy()
+
+    vl_all.setdefault(address, {})[sig_name] = values
+    ts_all.setdefault(address, {})[sig_name] = ts
+    vl_all.setdefault(name, {})[sig_name] = values
+    ts_all.setdefault(name, {})[sig_name] = ts
+  return vl_all, ts_all, errors
+
 cdef class CANDefine():
   cdef:
     const DBC *dbc
@@ -8,7 +8,46 @@ import jinja2
 from collections import Counter
 from opendbc.can.dbc import dbc
 
-def process(in_fn, out_fn):
+CHECKSUM_FUNCTIONS = {
+  "HONDA_CHECKSUM": "honda_checksum({address}, dat_be, {size})",
+  "TOYOTA_CHECKSUM": "toyota_checksum({address}, dat_be, {size})",
+  "VOLKSWAGEN_CHECKSUM": "volkswagen_crc({address}, dat_le, {size})",
+  "SUBARU_CHECKSUM": "subaru_checksum({address}, dat_be, {size})",
+  "CHRYSLER_CHECKSUM": "chrysler_checksum({address}, dat_le, {size})",
+  "PEDAL_CHECKSUM": "pedal_checksum(dat_be, {size})",
+}
+
+def signal_type(checksum_type, address, sig):
+  if address in [512, 513] and sig.name == "CHECKSUM_PEDAL":
+    return "PEDAL_CHECKSUM"
+  if address in [512, 513] and sig.name == "COUNTER_PEDAL":
+    return "PEDAL_COUNTER"
+  if checksum_type is not None and sig.name == "CHECKSUM":
+    return "%s_CHECKSUM" % checksum_type.upper()
+  if checksum_type in ("honda", "volkswagen") and sig.name == "COUNTER":
+    return "%s_COUNTER" % checksum_type.upper()
+  return "DEFAULT"
+
+def signal_b1(sig):
+  if sig.is_little_endian:
+    return sig.start_bit
+  return (sig.start_bit // 8) * 8 + (-sig.start_bit - 1) % 8
+
+def signal_extract(sig):
+  # constant shift and mask version of SignalTable::extract
+  b1 = signal_b1(sig)
+  shift = b1 if sig.is_little_endian else 64 - (b1 + sig.size)
+  src = "dat_le" if sig.is_little_endian else "dat_be"
+  raw = "((%s >> %d) & 0x%XULL)" % (src, shift, (1 << sig.size) - 1)
+  if sig.is_signed:
+    sign = 1 << (sig.size - 1)
+    raw = "((%s ^ 0x%XULL) - 0x%XULL)" % (raw, sign, sign)
+  return "(int64_t)%s" % raw
+
+def signal_value(sig):
+  return "(double)%s * %r + %r" % (signal_extract(sig), float(sig.factor), float(sig.offset))
+
+def process(in_fn, out_fn, specialize=True):
   dbc_name = os.path.split(out_fn)[-1].replace('.cc', '')
   # print("processing %s: %s -> %s" % (dbc_name, in_fn, out_fn))
 
@@ -104,7 +143,16 @@ def process(in_fn, out_fn):
     if count > 1:
       sys.exit("%s: Duplicate message name in DBC file %s" % (dbc_name, name))
 
-  parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals, len=len)
+  def checksum_call(address, msg_size, sigs):
+    for sig in sigs:
+      sig_type = signal_type(checksum_type, address, sig)
+      if sig_type in CHECKSUM_FUNCTIONS:
+        return "%s == %s" % (CHECKSUM_FUNCTIONS[sig_type].format(address="0x%X" % address, size=msg_size), signal_extract(sig))
+    return None
+
+  parser_code = template.render(dbc=can_dbc, checksum_type=checksum_type, msgs=msgs, def_vals=def_vals, len=len,
+                                specialize=specialize, signal_type=signal_type, signal_b1=signal_b1,
+                                signal_value=signal_value, checksum_call=checksum_call)
 
   with open(out_fn, "a+") as out_f:
     out_f.seek(0)
@@ -114,17 +162,18 @@ def process(in_fn, out_fn):
       out_f.write(parser_code)
 
 def main():
-  if len(sys.argv) != 3:
-    print("usage: %s dbc_directory output_filename" % (sys.argv[0],))
+  args = [a for a in sys.argv[1:] if a != "--generic"]
+  if len(args) != 2:
+    print("usage: %s [--generic] dbc_directory output_filename" % (sys.argv[0],))
     sys.exit(0)
 
-  dbc_dir = sys.argv[1]
-  out_fn = sys.argv[2]
+  dbc_dir = args[0]
+  out_fn = args[1]
 
   dbc_name = os.path.split(out_fn)[-1].replace('.cc', '')
   in_fn = os.path.join(dbc_dir, dbc_name + '.dbc')
 
-  process(in_fn, out_fn)
+  process(in_fn, out_fn, specialize="--generic" not in sys.argv)
 
 
 if __name__ == '__main__':
@@ -0,0 +1,18 @@
+#!/usr/bin/env python3
+import os
+import subprocess
+import unittest
+
+CAN_DIR = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..")
+
+
+class TestCanBench(unittest.TestCase):
+  def test_baseline(self):
+    # Fails when the parser or packer allocates more per step than can_bench_baseline.txt
+    bench = os.path.join(CAN_DIR, "can_bench")
+    baseline = os.path.join(CAN_DIR, "can_bench_baseline.txt")
+    subprocess.check_call([bench, "--baseline", baseline, "--iterations", "2"])
+
+
+if __name__ == "__main__":
+  unittest.main()
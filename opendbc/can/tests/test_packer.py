@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+import os
+import random
+import unittest
+
+from cereal import log
+from opendbc.can.dbc import dbc
+from opendbc.can.packer import CANPacker
+
+DBC_PATH = os.path.join(os.path.dirname(os.path.realpath(__file__)), "..", "..")
+DBCS = ["honda_civic_touring_2016_can_generated", "toyota_rav4_2017_pt_generated", "vw_mqb_2010", "hyundai_kia_generic"]
+
+
+def signal_bits(sig):
+  # Frame bit (byte * 8 + bit) of each bit of the raw value, lsb first
+  if sig.is_little_endian:
+    return [sig.start_bit + i for i in range(sig.size)]
+  msb = (sig.start_bit // 8) * 8 + (-sig.start_bit - 1) % 8  # counted from the first bit on the wire
+  return [(p // 8) * 8 + 7 - p % 8 for p in range(msb + sig.size - 1, msb - 1, -1)]
+
+
+def random_values(sigs):
+  # Values on the signal's raw grid, small enough for a double to hold them exactly.
+  # Names used by more than one signal of the message can't be packed by name
+  names = [sig.name for sig in sigs]
+  values = {}
+  for sig in sigs:
+    if sig.name == "CHECKSUM" or names.count(sig.name) > 1:
+      continue
+    size = min(sig.size, 32)
+    raw = random.getrandbits(size)
+    if sig.is_signed and size == sig.size and raw >= 1 << (size - 1):
+      raw -= 1 << size
+    values[sig.name] = raw * sig.factor + sig.offset
+  return values
+
+
+def reference_pack(size, sigs, values):
+  bits = [0] * 64
+  for sig in sigs:
+    if sig.name not in values:
+      continue
+    raw = int(round((values[sig.name] - sig.offset) / sig.factor))
+    for i, b in enumerate(signal_bits(sig)):
+      bits[b] = (raw >> i) & 1
+  return bytes(sum(bits[8 * i + j] << j for j in range(8)) for i in range(size))
+
+
+def clear_checksum(dat, sigs):
+  # The packer computes the checksum, the reference doesn't
+  dat = bytearray(dat)
+  for sig in sigs:
+    if sig.name == "CHECKSUM":
+      for b in signal_bits(sig):
+        dat[b // 8] &= ~(1 << (b % 8))
+  return bytes(dat)
+
+
+class TestPacker(unittest.TestCase):
+  def setUp(self):
+    random.seed(0)
+
+  def test_pack(self):
+    # make_can_msg packs signals by index, compare it to packing bit by bit from the DBC
+    for dbc_name in DBCS:
+      packer = CANPacker(dbc_name)
+      can_dbc = dbc(os.path.join(DBC_PATH, dbc_name + ".dbc"))
+      for address, ((_, size), sigs) in can_dbc.msgs.items():
+        if not sigs:
+          continue
+        for _ in range(20):
+          values = random_values(sigs)
+          _, _, dat, _ = packer.make_can_msg(address, 0, values)
+          self.assertEqual(clear_checksum(dat, sigs), reference_pack(size, sigs, values), f"{dbc_name} {address:#x}")
+
+  def test_make_sendcan(self):
+    # A sendcan event has the same frames as make_can_msg, and skips addresses the DBC doesn't have
+    for dbc_name in DBCS:
+      packer = CANPacker(dbc_name)
+      can_dbc = dbc(os.path.join(DBC_PATH, dbc_name + ".dbc"))
+      requests = []
+      for address, (_, sigs) in can_dbc.msgs.items():
+        if sigs:
+          requests.append([address, random.randint(0, 2), random_values(sigs), random.choice([-1, random.randint(0, 3)])])
+
+      bad_address = max(can_dbc.msgs) + 1
+      sendcan = packer.make_sendcan(requests + [[bad_address, 0, {}, -1]], valid=False)
+      event = log.Event.from_bytes(sendcan)
+      self.assertFalse(event.valid)
+      self.assertEqual(len(event.sendcan), len(requests))
+      for frame, (address, bus, values, counter) in zip(event.sendcan, requests):
+        expected = packer.make_can_msg(address, bus, values, counter)
+        self.assertEqual([frame.address, frame.busTime, frame.dat, frame.src], expected, f"{dbc_name} {address:#x}")
+
+
+if __name__ == "__main__":
+  unittest.main()
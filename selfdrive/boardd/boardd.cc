@@ -1,10 +1,13 @@
+#include <fcntl.h>
 #include <sched.h>
 #include <sys/cdefs.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <bitset>
 #include <cassert>
@@ -13,6 +16,7 @@
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <future>
 #include <thread>
 #include <unordered_map>
@@ -21,6 +25,8 @@
 
 #include "cereal/gen/cpp/car.capnp.h"
 #include "cereal/messaging/messaging.h"
+#include "cereal/messaging/msgq.h"
+#include "selfdrive/common/latency_histogram.h"
 #include "selfdrive/common/params.h"
 #include "selfdrive/common/swaglog.h"
 #include "selfdrive/common/timing.h"
@@ -29,6 +35,7 @@
 #include "selfdrive/locationd/ublox_msg.h"
 
 #include "selfdrive/boardd/panda.h"
+#include "selfdrive/boardd/panda_sim.h"
 #include "selfdrive/boardd/pigeon.h"
 
 #define MAX_IR_POWER 0.5f
@@ -116,7 +123,11 @@ bool safety_setter_thread(Panda *panda) {
 Panda *usb_connect() {
   std::unique_ptr<Panda> panda;
   try {
-    panda = std::make_unique<Panda>();
+    if (getenv("SIM_PANDA")) {
+      panda = std::make_unique<Panda>(new SimTransport(SimConfig::from_env()));
+    } else {
+      panda = std::make_unique<Panda>();
+    }
   } catch (std::exception &e) {
     return nullptr;
   }
@@ -170,11 +181,106 @@ Panda *usb_connect() {
   return panda.release();
 }
 
-void can_recv(Panda *panda, PubMaster &pm) {
-  kj::Array<capnp::word> can_data;
-  panda->can_receive(can_data);
-  auto bytes = can_data.asBytes();
-  pm.send("can", bytes.begin(), bytes.size());
+// Where the can events spend their time, published as canLatency once a second
+class CanLatencyTracer {
+public:
+  CanLatencyTracer() {
+    // The stats in the msgq header of can tell when the first reader got an event
+    if (messaging_use_zmq()) return;
+
+    int fd = open("/dev/shm/can", O_RDONLY);
+    if (fd < 0) return;
+    void *mem = mmap(NULL, sizeof(msgq_header_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem != MAP_FAILED) header = (const msgq_header_t *)mem;
+  }
+
+  ~CanLatencyTracer() {
+    if (header) munmap((void *)header, sizeof(msgq_header_t));
+  }
+
+  // Called before publishing an event. The header only has the newest first read, so it's
+  // sampled while that can only belong to the events published so far
+  void publishing() {
+    if (header) check_read();
+  }
+
+  // Called after publishing an event, with the time just before
+  void published(uint64_t usb_time, uint64_t publish_time) {
+    if (usb_time != 0) usb_to_publish.add(usb_time, publish_time);
+    if (header == nullptr) return;
+
+    if (pending_count == PENDING_EVENTS) {
+      pending_start = (pending_start + 1) % PENDING_EVENTS;
+      pending_count--;
+      unread++;
+    }
+    pending[(pending_start + pending_count++) % PENDING_EVENTS] = {__atomic_load_n(&header->write_pointer, __ATOMIC_ACQUIRE), publish_time};
+  }
+
+  // Publishes canLatency if the last one is a second old
+  void send(PubMaster &pm, uint64_t now) {
+    if (now - last_send_time < 1000000000ULL) return;
+    last_send_time = now;
+
+    MessageBuilder msg;
+    auto can_latency = msg.initEvent().initCanLatency();
+    usb_to_publish.write(can_latency.initUsbToPublish());
+    publish_to_read.write(can_latency.initPublishToRead());
+    can_latency.setUnread(unread);
+    pm.send("canLatency", msg);
+
+    usb_to_publish.reset();
+    publish_to_read.reset();
+    unread = 0;
+  }
+
+private:
+  // The header only has the newest first read. The events up to it were read by then, so a reader
+  // that catches up on several events at once still gets each of them measured
+  void check_read() {
+    if (pending_count == 0) return;
+
+    const uint64_t read_pointer = __atomic_load_n(&header->stats.first_read_pointer, __ATOMIC_ACQUIRE);
+    const uint64_t read_time = __atomic_load_n(&header->stats.first_read_ns, __ATOMIC_ACQUIRE);
+    while (pending_count > 0) {
+      const PendingEvent &e = pending[pending_start];
+      if (read_pointer < e.write_pointer || read_time < e.publish_time) break;
+
+      publish_to_read.add(e.publish_time, read_time);
+      pending_start = (pending_start + 1) % PENDING_EVENTS;
+      pending_count--;
+    }
+  }
+
+  struct PendingEvent {
+    uint64_t write_pointer; // write pointer after the event
+    uint64_t publish_time;
+  };
+  // Events no reader got yet, oldest first. The ones pushed out count as unread
+  static const size_t PENDING_EVENTS = 32;
+
+  const msgq_header_t *header = nullptr;
+  std::array<PendingEvent, PENDING_EVENTS> pending;
+  size_t pending_start = 0, pending_count = 0;
+  uint32_t unread = 0;
+  uint64_t last_send_time = 0;
+  LatencyHistogram usb_to_publish;
+  LatencyHistogram publish_to_read;
+};
+
+void can_publish(Panda *panda, PubMaster &pm, MessageBuilder &msg, CanLatencyTracer &tracer) {
+  tracer.publishing();
+  const uint64_t publish_time = nanos_since_boot();
+  pm.send("can", msg);
+  tracer.published(panda->can_recv_time, publish_time);
+  tracer.send(pm, publish_time);
+}
+
+void can_recv(Panda *panda, PubMaster &pm, kj::ArrayPtr<capnp::word> can_segment, CanLatencyTracer &tracer) {
+  MessageBuilder msg(can_segment);
+  panda->can_receive(msg);
+  can_publish(panda, pm, msg, tracer);
 }
 
 void can_send_thread(Panda *panda, bool fake_send) {
@@ -197,17 +303,22 @@ void can_send_thread(Panda *panda, bool fake_send) {
       continue;
     }
 
-    capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg));
-    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
+    // Whatever else was published by now goes into the same bulk writes
+    do {
+      capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg));
+      cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
 
-    //Dont send if older than 1 second
-    if (nanos_since_boot() - event.getLogMonoTime() < 1e9) {
-      if (!fake_send) {
-        panda->can_send(event.getSendcan());
+      //Dont send if older than 1 second, the time is taken per message since more are published during the drain
+      if (nanos_since_boot() - event.getLogMonoTime() < 1e9) {
+        if (!fake_send) {
+          panda->can_send_queue(event.getSendcan(), event.getLogMonoTime());
+        }
       }
-    }
 
-    delete msg;
+      delete msg;
+    } while ((msg = subscriber->receive(true)) != nullptr);
+
+    panda->can_send_flush();
   }
 
   delete subscriber;
@@ -218,14 +329,36 @@ void can_recv_thread(Panda *panda) {
   LOGD("start recv thread");
 
   // can = 8006
-  PubMaster pm({"can"});
+  PubMaster pm({"can", "canLatency"});
+  CanLatencyTracer tracer;
+
+  // Received frames are published at most this late, and can events come at most this often.
+  // controlsd runs once per can event, lower it only when that is expected.
+  const char *budget_env = getenv("BOARDD_CAN_LATENCY_BUDGET_US");
+  const uint64_t latency_budget = (budget_env ? std::atoi(budget_env) : 10000) * 1000ULL;
+
+  // The can events are built in the same segment every time and serialized straight into
+  // the socket, receiving doesn't allocate
+  kj::Array<capnp::word> can_segment = kj::heapArray<capnp::word>(CAN_EVENT_WORDS);
+  memset(can_segment.begin(), 0, can_segment.size() * sizeof(capnp::word));
+
+  if (panda->can_receive_start()) {
+    while (!do_exit && panda->connected) {
+      MessageBuilder msg(can_segment);
+      panda->can_receive_async(msg, latency_budget);
+      can_publish(panda, pm, msg, tracer);
+    }
+    panda->can_receive_stop();
+    return;
+  }
+  LOGW("async can receive failed, polling");
 
   // run at 100hz
   const uint64_t dt = 10000000ULL;
   uint64_t next_frame_time = nanos_since_boot() + dt;
 
   while (!do_exit && panda->connected) {
-    can_recv(panda, pm);
+    can_recv(panda, pm, can_segment, tracer);
 
     uint64_t cur_time = nanos_since_boot();
     int64_t remaining = next_frame_time - cur_time;
@@ -306,6 +439,18 @@ bool send_panda_state(PubMaster *pm, Panda *panda, bool spoofing_started) {
   ps[0].setHeartbeatLost((bool)(pandaState.heartbeat_lost));
   ps[0].setHarnessStatus(cereal::PandaState::HarnessStatus(pandaState.car_harness_status));
 
+  auto send_stats = panda->get_can_send_stats();
+  auto send_queues = ps[0].initCanSendQueues(send_stats.size());
+  for (size_t bus = 0; bus < send_stats.size(); bus++) {
+    const can_send_stats_t &stats = send_stats[bus];
+    send_queues[bus].setBus(bus);
+    send_queues[bus].setFrames(stats.frames);
+    send_queues[bus].setQueueDepthMax(stats.queue_depth_max);
+    send_queues[bus].setLatencyAvgUs(stats.frames > 0 ? stats.latency_sum_ns / stats.frames / 1000 : 0);
+    send_queues[bus].setLatencyMaxUs(stats.latency_max_ns / 1000);
+    send_queues[bus].setDropped(stats.dropped);
+  }
+
   // Convert faults bitset to capnp list
   std::bitset<sizeof(pandaState.faults) * 8> fault_bits(pandaState.faults);
   auto faults = ps[0].initFaults(fault_bits.count());
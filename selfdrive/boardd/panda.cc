@@ -2,6 +2,7 @@
 
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <stdexcept>
 #include <vector>
@@ -9,236 +10,40 @@
 #include "cereal/messaging/messaging.h"
 #include "selfdrive/common/gpio.h"
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
 #include "selfdrive/common/util.h"
 
-static int init_usb_ctx(libusb_context **context) {
-  assert(context != nullptr);
-
-  int err = libusb_init(context);
-  if (err != 0) {
-    LOGE("libusb initialization error");
-    return err;
-  }
-
-#if LIBUSB_API_VERSION >= 0x01000106
-  libusb_set_option(*context, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
-#else
-  libusb_set_debug(*context, 3);
-#endif
-
-  return err;
-}
-
-
-Panda::Panda(std::string serial) {
-  // init libusb
-  ssize_t num_devices;
-  libusb_device **dev_list = NULL;
-  int err = init_usb_ctx(&ctx);
-  if (err != 0) { goto fail; }
-
-  // connect by serial
-  num_devices = libusb_get_device_list(ctx, &dev_list);
-  if (num_devices < 0) { goto fail; }
-  for (size_t i = 0; i < num_devices; ++i) {
-    libusb_device_descriptor desc;
-    libusb_get_device_descriptor(dev_list[i], &desc);
-    if (desc.idVendor == 0xbbaa && desc.idProduct == 0xddcc) {
-      libusb_open(dev_list[i], &dev_handle);
-      if (dev_handle == NULL) { goto fail; }
-
-      unsigned char desc_serial[26] = { 0 };
-      int ret = libusb_get_string_descriptor_ascii(dev_handle, desc.iSerialNumber, desc_serial, std::size(desc_serial));
-      if (ret < 0) { goto fail; }
-
-      usb_serial = std::string((char *)desc_serial, ret).c_str();
-      if (serial.empty() || serial == usb_serial) {
-        break;
-      }
-      libusb_close(dev_handle);
-      dev_handle = NULL;
-    }
-  }
-  if (dev_handle == NULL) goto fail;
-  libusb_free_device_list(dev_list, 1);
-  dev_list = nullptr;
-
-  if (libusb_kernel_driver_active(dev_handle, 0) == 1) {
-    libusb_detach_kernel_driver(dev_handle, 0);
-  }
-
-  err = libusb_set_configuration(dev_handle, 1);
-  if (err != 0) { goto fail; }
-
-  err = libusb_claim_interface(dev_handle, 0);
-  if (err != 0) { goto fail; }
+Panda::Panda(std::string serial) : Panda(new UsbTransport(serial)) {}
 
+Panda::Panda(PandaTransport *t) : transport(t), connected(t->connected), comms_healthy(t->comms_healthy) {
   hw_type = get_hw_type();
 
   has_rtc = (hw_type == cereal::PandaState::PandaType::UNO) ||
             (hw_type == cereal::PandaState::PandaType::DOS);
-
-  return;
-
-fail:
-  if (dev_list != NULL) {
-    libusb_free_device_list(dev_list, 1);
-  }
-  cleanup();
-  throw std::runtime_error("Error connecting to panda");
 }
 
 Panda::~Panda() {
-  std::lock_guard lk(usb_lock);
-  cleanup();
-  connected = false;
-}
-
-void Panda::cleanup() {
-  if (dev_handle) {
-    libusb_release_interface(dev_handle, 0);
-    libusb_close(dev_handle);
-  }
-
-  if (ctx) {
-    libusb_exit(ctx);
-  }
+  can_receive_stop();
 }
 
 std::vector<std::string> Panda::list() {
-  // init libusb
-  ssize_t num_devices;
-  libusb_context *context = NULL;
-  libusb_device **dev_list = NULL;
-  std::vector<std::string> serials;
-
-  int err = init_usb_ctx(&context);
-  if (err != 0) { return serials; }
-
-  num_devices = libusb_get_device_list(context, &dev_list);
-  if (num_devices < 0) {
-    LOGE("libusb can't get device list");
-    goto finish;
-  }
-  for (size_t i = 0; i < num_devices; ++i) {
-    libusb_device *device = dev_list[i];
-    libusb_device_descriptor desc;
-    libusb_get_device_descriptor(device, &desc);
-    if (desc.idVendor == 0xbbaa && desc.idProduct == 0xddcc) {
-      libusb_device_handle *handle = NULL;
-      libusb_open(device, &handle);
-      unsigned char desc_serial[26] = { 0 };
-      int ret = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, desc_serial, std::size(desc_serial));
-      libusb_close(handle);
-
-      if (ret < 0) { goto finish; }
-      serials.push_back(std::string((char *)desc_serial, ret).c_str());
-    }
-  }
-
-finish:
-  if (dev_list != NULL) {
-    libusb_free_device_list(dev_list, 1);
-  }
-  if (context) {
-    libusb_exit(context);
-  }
-  return serials;
-}
-
-void Panda::handle_usb_issue(int err, const char func[]) {
-  LOGE_100("usb error %d \"%s\" in %s", err, libusb_strerror((enum libusb_error)err), func);
-  if (err == LIBUSB_ERROR_NO_DEVICE) {
-    LOGE("lost connection");
-    connected = false;
-  }
-  // TODO: check other errors, is simply retrying okay?
+  return UsbTransport::list();
 }
 
 int Panda::usb_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout) {
-  int err;
-  const uint8_t bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
-
-  if (!connected) {
-    return LIBUSB_ERROR_NO_DEVICE;
-  }
-
-  std::lock_guard lk(usb_lock);
-  do {
-    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, NULL, 0, timeout);
-    if (err < 0) handle_usb_issue(err, __func__);
-  } while (err < 0 && connected);
-
-  return err;
+  return transport->control_write(bRequest, wValue, wIndex, timeout);
 }
 
 int Panda::usb_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout) {
-  int err;
-  const uint8_t bmRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
-
-  if (!connected) {
-    return LIBUSB_ERROR_NO_DEVICE;
-  }
-
-  std::lock_guard lk(usb_lock);
-  do {
-    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
-    if (err < 0) handle_usb_issue(err, __func__);
-  } while (err < 0 && connected);
-
-  return err;
+  return transport->control_read(bRequest, wValue, wIndex, data, wLength, timeout);
 }
 
 int Panda::usb_bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
-  int err;
-  int transferred = 0;
-
-  if (!connected) {
-    return 0;
-  }
-
-  std::lock_guard lk(usb_lock);
-  do {
-    // Try sending can messages. If the receive buffer on the panda is full it will NAK
-    // and libusb will try again. After 5ms, it will time out. We will drop the messages.
-    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
-
-    if (err == LIBUSB_ERROR_TIMEOUT) {
-      LOGW("Transmit buffer full");
-      break;
-    } else if (err != 0 || length != transferred) {
-      handle_usb_issue(err, __func__);
-    }
-  } while(err != 0 && connected);
-
-  return transferred;
+  return transport->bulk_write(endpoint, data, length, timeout);
 }
 
 int Panda::usb_bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
-  int err;
-  int transferred = 0;
-
-  if (!connected) {
-    return 0;
-  }
-
-  std::lock_guard lk(usb_lock);
-
-  do {
-    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
-
-    if (err == LIBUSB_ERROR_TIMEOUT) {
-      break; // timeout is okay to exit, recv still happened
-    } else if (err == LIBUSB_ERROR_OVERFLOW) {
-      comms_healthy = false;
-      LOGE_100("overflow got 0x%x", transferred);
-    } else if (err != 0) {
-      handle_usb_issue(err, __func__);
-    }
-
-  } while(err != 0 && connected);
-
-  return transferred;
+  return transport->bulk_read(endpoint, data, length, timeout);
 }
 
 void Panda::set_safety_model(cereal::CarParams::SafetyModel safety_model, int safety_param) {
@@ -341,30 +146,97 @@ void Panda::send_heartbeat() {
 }
 
 void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
-  const int msg_count = can_data_list.size();
-  const int buf_size = msg_count*0x10;
-
-  if (send.size() < buf_size) {
-    send.resize(buf_size);
-  }
+  can_send_queue(can_data_list, nanos_since_boot());
+  can_send_flush();
+}
 
-  for (int i = 0; i < msg_count; i++) {
-    auto cmsg = can_data_list[i];
-    if (cmsg.getAddress() >= 0x800) { // extended
-      send[i*4] = (cmsg.getAddress() << 3) | 5;
+void Panda::can_send_queue(capnp::List<cereal::CanData>::Reader can_data_list, uint64_t mono_time) {
+  for (auto cmsg : can_data_list) {
+    SendFrame &f = send_queue.emplace_back();
+    const uint32_t address = cmsg.getAddress();
+    if (address >= 0x800) { // extended
+      f.record[0] = (address << 3) | 5;
+      f.priority = ((uint64_t)address << 1) | 1;
     } else { // normal
-      send[i*4] = (cmsg.getAddress() << 21) | 1;
+      f.record[0] = (address << 21) | 1;
+      // the 11 bits of a standard address are compared with the top bits of an extended one
+      f.priority = (uint64_t)address << 19;
     }
     auto can_data = cmsg.getDat();
     assert(can_data.size() <= 8);
-    send[i*4+1] = can_data.size() | (cmsg.getSrc() << 4);
-    memcpy(&send[i*4+2], can_data.begin(), can_data.size());
+    f.record[1] = can_data.size() | (cmsg.getSrc() << 4);
+    f.record[2] = f.record[3] = 0;
+    memcpy(&f.record[2], can_data.begin(), can_data.size());
+    f.mono_time = mono_time;
+  }
+}
+
+void Panda::can_send_flush() {
+  if (send_queue.empty()) return;
+
+  std::stable_sort(send_queue.begin(), send_queue.end(), [](const SendFrame &a, const SendFrame &b) {
+    return a.priority < b.priority;
+  });
+
+  const size_t msg_count = send_queue.size();
+  if (send.size() < msg_count*4) {
+    send.resize(msg_count*4);
+  }
+
+  std::array<uint32_t, PANDA_BUS_CNT> queue_depth = {};
+  for (size_t i = 0; i < msg_count; i++) {
+    memcpy(&send[i*4], send_queue[i].record, 0x10);
+    uint8_t bus = send_queue[i].record[1] >> 4;
+    if (bus < PANDA_BUS_CNT) queue_depth[bus]++;
+  }
+
+  // A short write means the panda's buffer is full, what wasn't transferred is dropped
+  const size_t frames_per_write = SEND_SIZE / 0x10;
+  bool full = false;
+  for (size_t i = 0; i < msg_count; i += frames_per_write) {
+    const size_t n = std::min(frames_per_write, msg_count - i);
+    size_t sent = 0;
+    if (!full) {
+      const int transferred = usb_bulk_write(3, (unsigned char*)&send[i*4], n*0x10, 5);
+      sent = std::clamp(transferred, 0, (int)(n*0x10)) / 0x10;
+      full = sent < n;
+    }
+
+    const uint64_t now = nanos_since_boot();
+    std::lock_guard lk(send_stats_lock);
+    for (size_t j = i; j < i + n; j++) {
+      uint8_t bus = send_queue[j].record[1] >> 4;
+      if (bus >= PANDA_BUS_CNT) continue;
+
+      can_send_stats_t &stats = send_stats[bus];
+      if (j >= i + sent) {
+        stats.dropped++;
+        continue;
+      }
+      const uint64_t latency = now - send_queue[j].mono_time;
+      stats.frames++;
+      stats.latency_sum_ns += latency;
+      stats.latency_max_ns = std::max(stats.latency_max_ns, latency);
+    }
   }
 
-  usb_bulk_write(3, (unsigned char*)send.data(), buf_size, 5);
+  {
+    std::lock_guard lk(send_stats_lock);
+    for (int bus = 0; bus < PANDA_BUS_CNT; bus++) {
+      send_stats[bus].queue_depth_max = std::max(send_stats[bus].queue_depth_max, queue_depth[bus]);
+    }
+  }
+  send_queue.clear();
+}
+
+std::array<can_send_stats_t, PANDA_BUS_CNT> Panda::get_can_send_stats() {
+  std::lock_guard lk(send_stats_lock);
+  std::array<can_send_stats_t, PANDA_BUS_CNT> ret = send_stats;
+  send_stats = {};
+  return ret;
 }
 
-int Panda::can_receive(kj::Array<capnp::word>& out_buf) {
+int Panda::can_receive(MessageBuilder &msg) {
   uint32_t data[RECV_SIZE/4];
   int recv = usb_bulk_read(0x81, (unsigned char*)data, RECV_SIZE);
 
@@ -375,27 +247,89 @@ int Panda::can_receive(kj::Array<capnp::word>& out_buf) {
     LOGW("Receive buffer full");
   }
 
-  size_t num_msg = recv / 0x10;
-  MessageBuilder msg;
-  auto evt = msg.initEvent();
-  evt.setValid(comms_healthy);
-
-  // populate message
-  auto canData = evt.initCan(num_msg);
-  for (int i = 0; i < num_msg; i++) {
-    if (data[i*4] & 4) {
-      // extended
-      canData[i].setAddress(data[i*4] >> 3);
-      //printf("got extended: %x\n", data[i*4] >> 3);
-    } else {
-      // normal
-      canData[i].setAddress(data[i*4] >> 21);
+  can_recv_time = (recv > 0) ? nanos_since_boot() : 0;
+  can_unpack(data, recv, msg);
+  return recv;
+}
+
+void Panda::can_unpack(const uint32_t *data, int recv, MessageBuilder &msg) {
+  const int num_msg = recv / 0x10;
+  auto canData = msg.initEvent(comms_healthy).initCan(num_msg);
+
+  // populate message, the records are
+  // [0] address << 21 (normal) or address << 3 | 4 (extended)
+  // [1] len | src << 4 | busTime << 16
+  // [2..3] data
+  for (int i = 0; i < num_msg; i++, data += 4) {
+    auto c = canData[i];
+    const uint32_t w0 = data[0], w1 = data[1];
+    c.setAddress((w0 & 4) ? (w0 >> 3) : (w0 >> 21));
+    c.setBusTime(w1 >> 16);
+    c.setSrc((w1 >> 4) & 0xff);
+    c.setDat(kj::arrayPtr((const uint8_t*)&data[2], w1 & 0xF));
+  }
+}
+
+void Panda::recv_push(const unsigned char *data, int length) {
+  std::lock_guard lk(recv_lock);
+  if (recv_pending.size() + length > RECV_QUEUE_SIZE) {
+    LOGE_100("can receive queue full, dropping 0x%x", length);
+    return;
+  }
+  // only the first chunk can wake up a waiting can_receive_async
+  if (recv_pending.empty()) {
+    recv_pending_time = nanos_since_boot();
+    recv_cv.notify_all();
+  }
+  recv_pending.insert(recv_pending.end(), data, data + length);
+}
+
+bool Panda::can_receive_start(int num_transfers) {
+  {
+    std::lock_guard lk(recv_lock);
+    assert(!recv_running);
+    recv_running = true;
+    recv_last_time = nanos_since_boot();
+    // swapped every can_receive_async, reserved so receiving doesn't allocate
+    recv_pending.reserve(RECV_QUEUE_SIZE);
+    recv_out.reserve(RECV_QUEUE_SIZE);
+  }
+
+  auto on_data = [this](const unsigned char *data, int length) { recv_push(data, length); };
+  if (!transport->bulk_read_start(0x81, RECV_SIZE, num_transfers, on_data)) {
+    can_receive_stop();
+    return false;
+  }
+  return true;
+}
+
+void Panda::can_receive_stop() {
+  transport->bulk_read_stop();
+
+  std::lock_guard lk(recv_lock);
+  recv_running = false;
+  recv_cv.notify_all();
+}
+
+int Panda::can_receive_async(MessageBuilder &msg, uint64_t latency_budget_ns) {
+  {
+    std::unique_lock lk(recv_lock);
+    uint64_t deadline, now;
+    while (true) {
+      deadline = recv_last_time + (recv_pending.empty() ? std::max<uint64_t>(latency_budget_ns, RECV_IDLE_NS) : latency_budget_ns);
+      now = nanos_since_boot();
+      if (now >= deadline || !recv_running || !connected) break;
+      recv_cv.wait_for(lk, std::chrono::nanoseconds(deadline - now));
     }
-    canData[i].setBusTime(data[i*4+1] >> 16);
-    int len = data[i*4+1]&0xF;
-    canData[i].setDat(kj::arrayPtr((uint8_t*)&data[i*4+2], len));
-    canData[i].setSrc((data[i*4+1] >> 4) & 0xff);
+    // keep the cadence unless the caller fell behind by more than a budget
+    recv_last_time = (now < deadline + latency_budget_ns) ? deadline : now;
+
+    recv_out.clear();
+    recv_out.swap(recv_pending);
+    can_recv_time = recv_out.empty() ? 0 : recv_pending_time;
   }
-  out_buf = capnp::messageToFlatArray(msg);
+
+  int recv = recv_out.size() - recv_out.size() % 0x10;
+  can_unpack((const uint32_t *)recv_out.data(), recv, msg);
   return recv;
 }
@@ -1,20 +1,36 @@
 #pragma once
 
+#include <array>
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
 #include <ctime>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <vector>
 
-#include <libusb-1.0/libusb.h>
-
 #include "cereal/gen/cpp/car.capnp.h"
 #include "cereal/gen/cpp/log.capnp.h"
+#include "selfdrive/boardd/panda_transport.h"
 
 // double the FIFO size
 #define RECV_SIZE (0x1000)
-#define TIMEOUT 0
+// bulk reads kept in flight by the asynchronous receive
+#define RECV_TRANSFERS 4
+// received data the asynchronous receive holds before dropping chunks
+#define RECV_QUEUE_SIZE (RECV_SIZE*16)
+// an empty can event is returned after this long without data
+#define RECV_IDLE_NS 10000000ULL
+// first segment that holds a can event of RECV_QUEUE_SIZE, each frame is
+// a CanData struct of two words and a word of data
+#define CAN_EVENT_WORDS (RECV_QUEUE_SIZE / 0x10 * 3 + 64)
+
+// most can frames in one bulk write of the send endpoint
+#define SEND_SIZE (0x1000)
+#define PANDA_BUS_CNT 4
+
+class MessageBuilder;
 
 // copied from panda/board/main.c
 struct __attribute__((packed)) health_t {
@@ -40,24 +56,52 @@ struct __attribute__((packed)) health_t {
 };
 
 
+// Per bus stats of the sent can frames
+struct can_send_stats_t {
+  uint32_t frames;          // sent, only the ones the bulk writes transferred
+  uint32_t dropped;         // not transferred, the panda's buffer was full
+  uint32_t queue_depth_max; // most frames of the bus in one can_send_flush
+  uint64_t latency_sum_ns;  // from the sendcan logMonoTime to the end of the bulk write
+  uint64_t latency_max_ns;
+};
+
 class Panda {
  private:
-  libusb_context *ctx = NULL;
-  libusb_device_handle *dev_handle = NULL;
-  std::mutex usb_lock;
+  std::unique_ptr<PandaTransport> transport;
   std::vector<uint32_t> send;
-  void handle_usb_issue(int err, const char func[]);
-  void cleanup();
+
+  struct SendFrame {
+    uint64_t priority;
+    uint64_t mono_time;
+    uint32_t record[4];
+  };
+  std::vector<SendFrame> send_queue;
+  std::mutex send_stats_lock;
+  std::array<can_send_stats_t, PANDA_BUS_CNT> send_stats = {};
+  void can_unpack(const uint32_t *data, int recv, MessageBuilder &msg);
+
+  // Asynchronous receive, recv_push gets the data from the transport's thread
+  std::mutex recv_lock;
+  std::condition_variable recv_cv;
+  std::vector<uint8_t> recv_pending; // received data not yet returned
+  std::vector<uint8_t> recv_out;
+  uint64_t recv_pending_time = 0; // when the oldest pending data came in
+  uint64_t recv_last_time = 0; // when can_receive_async last returned
+  bool recv_running = false;
+  void recv_push(const unsigned char *data, int length);
 
  public:
   Panda(std::string serial="");
+  // Takes ownership of transport
+  Panda(PandaTransport *transport);
   ~Panda();
 
-  std::string usb_serial;
-  std::atomic<bool> connected = true;
-  std::atomic<bool> comms_healthy = true;
+  std::atomic<bool> &connected;
+  std::atomic<bool> &comms_healthy;
   cereal::PandaState::PandaType hw_type = cereal::PandaState::PandaType::UNKNOWN;
   bool has_rtc = false;
+  // USB completion of the oldest data in the last can event, 0 if it had none
+  uint64_t can_recv_time = 0;
 
   // Static functions
   static std::vector<std::string> list();
@@ -85,5 +129,22 @@ class Panda {
   void set_usb_power_mode(cereal::PeripheralState::UsbPowerMode power_mode);
   void send_heartbeat();
   void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
-  int can_receive(kj::Array<capnp::word>& out_buf);
+  // Queues the frames of a sendcan event published at mono_time for can_send_flush
+  void can_send_queue(capnp::List<cereal::CanData>::Reader can_data_list, uint64_t mono_time);
+  // Sends the queued frames in bulk writes of up to SEND_SIZE, in the order they win bus
+  // arbitration: lowest address first, standard before extended. An address keeps its order.
+  void can_send_flush();
+  // Stats since the last call
+  std::array<can_send_stats_t, PANDA_BUS_CNT> get_can_send_stats();
+  // The can functions build their event in msg, see CAN_EVENT_WORDS to do it without allocating
+  int can_receive(MessageBuilder &msg);
+
+  // Keeps num_transfers bulk reads of the can endpoint in flight on the transport's thread,
+  // so the panda FIFO is emptied as soon as data comes in. Use can_receive_async afterwards.
+  bool can_receive_start(int num_transfers=RECV_TRANSFERS);
+  void can_receive_stop();
+  // Returns the data received since the last call as one can event. Data waits at most
+  // latency_budget_ns and events come at most once per budget, or every RECV_IDLE_NS
+  // when nothing is received.
+  int can_receive_async(MessageBuilder &msg, uint64_t latency_budget_ns);
 };
@@ -0,0 +1,250 @@
+#include "selfdrive/boardd/panda_sim.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "cereal/messaging/messaging.h"
+#include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/timing.h"
+#include "selfdrive/common/util.h"
+
+// one full speed USB frame, the async reads complete at most this often
+#define SIM_USB_FRAME_NS 1000000ULL
+
+static double env_double(const char *name, double default_value) {
+  const char *value = getenv(name);
+  return value ? std::atof(value) : default_value;
+}
+
+// A can frame as the panda sends it over USB, see Panda::can_unpack
+static std::array<uint32_t, 4> can_record(uint32_t address, uint8_t src, uint16_t bus_time, const uint8_t *dat, int len) {
+  std::array<uint32_t, 4> r = {0};
+  r[0] = (address >= 0x800) ? ((address << 3) | 4) : (address << 21);
+  r[1] = len | (src << 4) | (bus_time << 16);
+  memcpy(&r[2], dat, len);
+  return r;
+}
+
+SimConfig SimConfig::from_env() {
+  SimConfig config;
+  config.can_rate = env_double("SIM_PANDA_CAN_RATE", config.can_rate);
+  config.num_buses = env_double("SIM_PANDA_BUSES", config.num_buses);
+  config.usb_latency_ns = env_double("SIM_PANDA_USB_LATENCY_US", config.usb_latency_ns / 1000) * 1000;
+  config.replay_speed = env_double("SIM_PANDA_REPLAY_SPEED", config.replay_speed);
+  if (const char *replay = getenv("SIM_PANDA_REPLAY")) {
+    config.replay = replay;
+  }
+
+  config.health.voltage = 12000;
+  config.health.current = 500;
+  config.health.ignition_line = env_double("SIM_PANDA_IGNITION", 1);
+  config.health.car_harness_status = 1;
+  config.health.usb_power_mode = (uint8_t)cereal::PeripheralState::UsbPowerMode::CDP;
+  return config;
+}
+
+SimTransport::SimTransport(const SimConfig &c) : config(c) {
+  assert(config.num_buses > 0 && config.replay_speed > 0 && config.can_rate >= 0);
+  hw_serial = "simulated";
+  start_time = nanos_since_boot();
+
+  if (!config.replay.empty()) {
+    std::string log = util::read_file(config.replay);
+    kj::Array<capnp::word> buf = kj::heapArray<capnp::word>(log.size() / sizeof(capnp::word));
+    memcpy(buf.begin(), log.data(), buf.size() * sizeof(capnp::word));
+
+    capnp::ReaderOptions options;
+    options.traversalLimitInWords = kj::maxValue;
+    kj::ArrayPtr<const capnp::word> words = buf.asPtr();
+    uint64_t first = 0;
+    while (words.size() > 0) {
+      capnp::FlatArrayMessageReader reader(words, options);
+      words = kj::arrayPtr(reader.getEnd(), words.end());
+
+      cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+      if (event.which() != cereal::Event::CAN) continue;
+      if (first == 0) first = event.getLogMonoTime();
+
+      uint64_t t = (event.getLogMonoTime() - first) / config.replay_speed;
+      for (auto c : event.getCan()) {
+        auto dat = c.getDat();
+        if (dat.size() > 8) continue;
+        replay_frames.push_back({t, can_record(c.getAddress(), c.getSrc(), c.getBusTime(), dat.begin(), dat.size())});
+      }
+    }
+
+    if (replay_frames.empty()) {
+      throw std::runtime_error("no can frames to replay in " + config.replay);
+    }
+    // the replay loops, with one 10ms cycle between the last frame and the first
+    replay_duration = replay_frames.back().time + 10000000ULL / config.replay_speed;
+    LOGW("simulated panda replaying %zu can frames of %s", replay_frames.size(), config.replay.c_str());
+  } else {
+    LOGW("simulated panda sending %.0f can frames/s on %d buses", config.can_rate, config.num_buses);
+  }
+}
+
+SimTransport::~SimTransport() {
+  bulk_read_stop();
+  connected = false;
+  LOGW("simulated panda: %llu can frames received, %u lost to FIFO overflows, %u sent", (unsigned long long)generated, fifo_overflows, sent);
+}
+
+void SimTransport::usb_delay() {
+  if (config.usb_latency_ns > 0) {
+    std::this_thread::sleep_for(std::chrono::nanoseconds(config.usb_latency_ns));
+  }
+}
+
+void SimTransport::generate(uint64_t now) {
+  // every frame due by now goes into the FIFO, or is lost when it is full like on the panda
+  while (true) {
+    std::array<uint32_t, 4> record;
+    if (replay_frames.empty()) {
+      if (config.can_rate == 0) break; // idle bus
+      uint64_t t = start_time + generated * 1e9 / config.can_rate;
+      if (t > now) break;
+
+      uint8_t bus = generated % config.num_buses;
+      uint32_t address = 0x100 + (generated / config.num_buses) % 0x40;
+      record = can_record(address, bus, (t / 1000) & 0xFFFF, (const uint8_t *)&t, sizeof(t));
+    } else {
+      const Frame &f = replay_frames[generated % replay_frames.size()];
+      uint64_t t = start_time + (generated / replay_frames.size()) * replay_duration + f.time;
+      if (t > now) break;
+      record = f.record;
+    }
+    generated++;
+
+    if (fifo.size() >= config.fifo_frames) {
+      fifo_overflows++;
+    } else {
+      fifo.push_back(record);
+    }
+  }
+}
+
+int SimTransport::drain(unsigned char *data, int length) {
+  std::lock_guard lk(fifo_lock);
+  generate(nanos_since_boot());
+
+  int n = 0;
+  while (!fifo.empty() && n + 0x10 <= length) {
+    memcpy(&data[n], fifo.front().data(), 0x10);
+    fifo.pop_front();
+    n += 0x10;
+  }
+  return n;
+}
+
+int SimTransport::control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout) {
+  if (!connected) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  usb_delay();
+
+  if (bRequest == 0xdc) {
+    std::lock_guard lk(fifo_lock);
+    safety_model = wValue;
+    safety_param = wIndex;
+  }
+  return 0;
+}
+
+int SimTransport::control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout) {
+  if (!connected) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+  usb_delay();
+
+  switch (bRequest) {
+    case 0xc1: // hw type
+      data[0] = (uint8_t)config.hw_type;
+      return 1;
+    case 0xd2: { // health
+      health_t health = config.health;
+      {
+        std::lock_guard lk(fifo_lock);
+        health.uptime = (nanos_since_boot() - start_time) / 1000000000ULL;
+        health.can_rx_errs += fifo_overflows;
+        health.safety_model = safety_model;
+        health.safety_param = safety_param;
+      }
+      int len = std::min<int>(wLength, sizeof(health));
+      memcpy(data, &health, len);
+      return len;
+    }
+    case 0xd3: // firmware signature
+    case 0xd4:
+      memset(data, bRequest, wLength);
+      return wLength;
+    case 0xd0: { // serial
+      int len = std::min<int>(wLength, hw_serial.size());
+      memcpy(data, hw_serial.data(), len);
+      return len;
+    }
+    default:
+      return 0;
+  }
+}
+
+int SimTransport::bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  if (!connected) {
+    return 0;
+  }
+  usb_delay();
+
+  if (endpoint == 3) {
+    std::lock_guard lk(fifo_lock);
+    sent += length / 0x10;
+  }
+  return length;
+}
+
+int SimTransport::bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  if (!connected) {
+    return 0;
+  }
+  usb_delay();
+  return endpoint == 0x81 ? drain(data, length) : 0;
+}
+
+void SimTransport::read_loop(int length, int num_transfers, DataCallback on_data) {
+  std::vector<unsigned char> buf(length);
+  uint64_t next_frame_time = nanos_since_boot();
+
+  while (read_running && connected) {
+    next_frame_time += SIM_USB_FRAME_NS;
+    int64_t remaining = next_frame_time - nanos_since_boot();
+    if (remaining > 0) {
+      std::this_thread::sleep_for(std::chrono::nanoseconds(remaining));
+    }
+
+    // each transfer in flight can complete once per frame
+    for (int i = 0; i < num_transfers; i++) {
+      int n = drain(buf.data(), length);
+      if (n == 0) break;
+      usb_delay();
+      on_data(buf.data(), n);
+    }
+  }
+}
+
+bool SimTransport::bulk_read_start(unsigned char endpoint, int length, int num_transfers, DataCallback on_data) {
+  assert(!read_thread.joinable());
+  if (!connected || endpoint != 0x81) return false;
+
+  read_running = true;
+  read_thread = std::thread(&SimTransport::read_loop, this, length, num_transfers, on_data);
+  return true;
+}
+
+void SimTransport::bulk_read_stop() {
+  read_running = false;
+  if (read_thread.joinable()) {
+    read_thread.join();
+  }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "selfdrive/boardd/panda.h"
+
+// Settings of the simulated panda, from the SIM_PANDA_* environment variables
+struct SimConfig {
+  double can_rate = 3000;                 // frames/s over all buses, 0 for an idle bus, SIM_PANDA_CAN_RATE
+  int num_buses = 3;                      // SIM_PANDA_BUSES
+  uint64_t usb_latency_ns = 100000;       // added to every request and transfer, SIM_PANDA_USB_LATENCY_US
+  size_t fifo_frames = RECV_SIZE / 0x20;  // can receive FIFO of the panda, half of RECV_SIZE
+  std::string replay;                     // decompressed rlog to replay instead of synthesized frames, SIM_PANDA_REPLAY
+  double replay_speed = 1.0;              // SIM_PANDA_REPLAY_SPEED
+  cereal::PandaState::PandaType hw_type = cereal::PandaState::PandaType::BLACK_PANDA;
+  health_t health = {};                   // returned by get_state, with the uptime, safety and errors kept up to date
+
+  static SimConfig from_env();
+};
+
+// In-process panda for running and profiling boardd without hardware. It fills a can FIFO
+// at the configured rate and empties it on the reads of the can endpoint like the panda does.
+// Synthesized frames carry their generation time, nanos_since_boot, as 8 bytes of data.
+class SimTransport : public PandaTransport {
+  SimConfig config;
+  uint64_t start_time;
+
+  struct Frame {
+    uint64_t time; // relative to start_time
+    std::array<uint32_t, 4> record; // as in the USB can records
+  };
+  std::vector<Frame> replay_frames;
+  uint64_t replay_duration = 0;
+
+  std::mutex fifo_lock;
+  std::deque<std::array<uint32_t, 4>> fifo;
+  uint64_t generated = 0;
+  uint32_t fifo_overflows = 0;
+  uint32_t sent = 0;
+  uint16_t safety_model = 0;
+  int16_t safety_param = 0;
+  void generate(uint64_t now);
+  int drain(unsigned char *data, int length);
+  void usb_delay();
+
+  std::thread read_thread;
+  std::atomic<bool> read_running = false;
+  void read_loop(int length, int num_transfers, DataCallback on_data);
+
+ public:
+  SimTransport(const SimConfig &config);
+  ~SimTransport();
+
+  int control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout=TIMEOUT);
+  int control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout=TIMEOUT);
+  int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  bool bulk_read_start(unsigned char endpoint, int length, int num_transfers, DataCallback on_data);
+  void bulk_read_stop();
+};
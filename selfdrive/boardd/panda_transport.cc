@@ -0,0 +1,327 @@
+#include "selfdrive/boardd/panda_transport.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "selfdrive/common/swaglog.h"
+
+static int init_usb_ctx(libusb_context **context) {
+  assert(context != nullptr);
+
+  int err = libusb_init(context);
+  if (err != 0) {
+    LOGE("libusb initialization error");
+    return err;
+  }
+
+#if LIBUSB_API_VERSION >= 0x01000106
+  libusb_set_option(*context, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
+#else
+  libusb_set_debug(*context, 3);
+#endif
+
+  return err;
+}
+
+
+UsbTransport::UsbTransport(std::string serial) {
+  // init libusb
+  ssize_t num_devices;
+  libusb_device **dev_list = NULL;
+  int err = init_usb_ctx(&ctx);
+  if (err != 0) { goto fail; }
+
+  // connect by serial
+  num_devices = libusb_get_device_list(ctx, &dev_list);
+  if (num_devices < 0) { goto fail; }
+  for (size_t i = 0; i < num_devices; ++i) {
+    libusb_device_descriptor desc;
+    libusb_get_device_descriptor(dev_list[i], &desc);
+    if (desc.idVendor == 0xbbaa && desc.idProduct == 0xddcc) {
+      libusb_open(dev_list[i], &dev_handle);
+      if (dev_handle == NULL) { goto fail; }
+
+      unsigned char desc_serial[26] = { 0 };
+      int ret = libusb_get_string_descriptor_ascii(dev_handle, desc.iSerialNumber, desc_serial, std::size(desc_serial));
+      if (ret < 0) { goto fail; }
+
+      hw_serial = std::string((char *)desc_serial, ret).c_str();
+      if (serial.empty() || serial == hw_serial) {
+        break;
+      }
+      libusb_close(dev_handle);
+      dev_handle = NULL;
+    }
+  }
+  if (dev_handle == NULL) goto fail;
+  libusb_free_device_list(dev_list, 1);
+  dev_list = nullptr;
+
+  if (libusb_kernel_driver_active(dev_handle, 0) == 1) {
+    libusb_detach_kernel_driver(dev_handle, 0);
+  }
+
+  err = libusb_set_configuration(dev_handle, 1);
+  if (err != 0) { goto fail; }
+
+  err = libusb_claim_interface(dev_handle, 0);
+  if (err != 0) { goto fail; }
+
+  return;
+
+fail:
+  if (dev_list != NULL) {
+    libusb_free_device_list(dev_list, 1);
+  }
+  cleanup();
+  throw std::runtime_error("Error connecting to panda");
+}
+
+UsbTransport::~UsbTransport() {
+  bulk_read_stop();
+  std::lock_guard lk(usb_lock);
+  cleanup();
+  connected = false;
+}
+
+void UsbTransport::cleanup() {
+  if (dev_handle) {
+    libusb_release_interface(dev_handle, 0);
+    libusb_close(dev_handle);
+  }
+
+  if (ctx) {
+    libusb_exit(ctx);
+  }
+}
+
+std::vector<std::string> UsbTransport::list() {
+  // init libusb
+  ssize_t num_devices;
+  libusb_context *context = NULL;
+  libusb_device **dev_list = NULL;
+  std::vector<std::string> serials;
+
+  int err = init_usb_ctx(&context);
+  if (err != 0) { return serials; }
+
+  num_devices = libusb_get_device_list(context, &dev_list);
+  if (num_devices < 0) {
+    LOGE("libusb can't get device list");
+    goto finish;
+  }
+  for (size_t i = 0; i < num_devices; ++i) {
+    libusb_device *device = dev_list[i];
+    libusb_device_descriptor desc;
+    libusb_get_device_descriptor(device, &desc);
+    if (desc.idVendor == 0xbbaa && desc.idProduct == 0xddcc) {
+      libusb_device_handle *handle = NULL;
+      libusb_open(device, &handle);
+      unsigned char desc_serial[26] = { 0 };
+      int ret = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, desc_serial, std::size(desc_serial));
+      libusb_close(handle);
+
+      if (ret < 0) { goto finish; }
+      serials.push_back(std::string((char *)desc_serial, ret).c_str());
+    }
+  }
+
+finish:
+  if (dev_list != NULL) {
+    libusb_free_device_list(dev_list, 1);
+  }
+  if (context) {
+    libusb_exit(context);
+  }
+  return serials;
+}
+
+void UsbTransport::handle_usb_issue(int err, const char func[]) {
+  LOGE_100("usb error %d \"%s\" in %s", err, libusb_strerror((enum libusb_error)err), func);
+  if (err == LIBUSB_ERROR_NO_DEVICE) {
+    LOGE("lost connection");
+    connected = false;
+  }
+  // TODO: check other errors, is simply retrying okay?
+}
+
+int UsbTransport::control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout) {
+  int err;
+  const uint8_t bmRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+
+  if (!connected) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  std::lock_guard lk(usb_lock);
+  do {
+    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, NULL, 0, timeout);
+    if (err < 0) handle_usb_issue(err, __func__);
+  } while (err < 0 && connected);
+
+  return err;
+}
+
+int UsbTransport::control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout) {
+  int err;
+  const uint8_t bmRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+
+  if (!connected) {
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  std::lock_guard lk(usb_lock);
+  do {
+    err = libusb_control_transfer(dev_handle, bmRequestType, bRequest, wValue, wIndex, data, wLength, timeout);
+    if (err < 0) handle_usb_issue(err, __func__);
+  } while (err < 0 && connected);
+
+  return err;
+}
+
+int UsbTransport::bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  int err;
+  int transferred = 0;
+
+  if (!connected) {
+    return 0;
+  }
+
+  std::lock_guard lk(usb_lock);
+  do {
+    // Try sending can messages. If the receive buffer on the panda is full it will NAK
+    // and libusb will try again. After 5ms, it will time out. We will drop the messages.
+    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
+
+    if (err == LIBUSB_ERROR_TIMEOUT) {
+      LOGW("Transmit buffer full");
+      break;
+    } else if (err != 0 || length != transferred) {
+      handle_usb_issue(err, __func__);
+    }
+  } while(err != 0 && connected);
+
+  return transferred;
+}
+
+int UsbTransport::bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout) {
+  int err;
+  int transferred = 0;
+
+  if (!connected) {
+    return 0;
+  }
+
+  std::lock_guard lk(usb_lock);
+
+  do {
+    err = libusb_bulk_transfer(dev_handle, endpoint, data, length, &transferred, timeout);
+
+    if (err == LIBUSB_ERROR_TIMEOUT) {
+      break; // timeout is okay to exit, recv still happened
+    } else if (err == LIBUSB_ERROR_OVERFLOW) {
+      comms_healthy = false;
+      LOGE_100("overflow got 0x%x", transferred);
+    } else if (err != 0) {
+      handle_usb_issue(err, __func__);
+    }
+
+  } while(err != 0 && connected);
+
+  return transferred;
+}
+
+void LIBUSB_CALL UsbTransport::read_callback(libusb_transfer *transfer) {
+  UsbTransport *usb = (UsbTransport *)transfer->user_data;
+
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+      if (transfer->actual_length > 0) {
+        usb->on_data(transfer->buffer, transfer->actual_length);
+      }
+      break;
+    case LIBUSB_TRANSFER_OVERFLOW:
+      usb->comms_healthy = false;
+      LOGE_100("overflow got 0x%x", transfer->actual_length);
+      break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      LOGE("lost connection");
+      usb->connected = false;
+      break;
+    case LIBUSB_TRANSFER_CANCELLED:
+      break;
+    default:
+      LOGE_100("usb transfer error %d in %s", transfer->status, __func__);
+      break;
+  }
+
+  // resubmit under the lock, so bulk_read_stop either sees it in flight or it isn't resubmitted
+  std::lock_guard lk(usb->read_lock);
+  if (usb->read_running && usb->connected) {
+    int err = libusb_submit_transfer(transfer);
+    if (err == 0) return;
+    usb->handle_usb_issue(err, __func__);
+  }
+  usb->read_in_flight--;
+}
+
+void UsbTransport::read_event_loop() {
+  while (true) {
+    {
+      std::lock_guard lk(read_lock);
+      if (!read_running && read_in_flight == 0) break;
+    }
+    struct timeval tv = {0, 100000};
+    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+  }
+}
+
+bool UsbTransport::bulk_read_start(unsigned char endpoint, int length, int num_transfers, DataCallback callback) {
+  assert(!read_running && !read_thread.joinable());
+  if (!connected) return false;
+
+  std::lock_guard lk(read_lock);
+  on_data = callback;
+  read_running = true;
+  for (int i = 0; i < num_transfers; i++) {
+    libusb_transfer *transfer = libusb_alloc_transfer(0);
+    unsigned char *buf = (unsigned char *)malloc(length);
+    libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buf, length, read_callback, this, TIMEOUT);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    read_transfers.push_back(transfer);
+
+    int err = libusb_submit_transfer(transfer);
+    if (err != 0) {
+      handle_usb_issue(err, __func__);
+      break;
+    }
+    read_in_flight++;
+  }
+
+  read_thread = std::thread(&UsbTransport::read_event_loop, this);
+  if (read_in_flight == 0) {
+    LOGE("can't submit bulk read transfers");
+    read_running = false;
+    return false;
+  }
+  return true;
+}
+
+void UsbTransport::bulk_read_stop() {
+  {
+    std::lock_guard lk(read_lock);
+    if (!read_thread.joinable()) return;
+    read_running = false;
+    for (auto transfer : read_transfers) {
+      libusb_cancel_transfer(transfer);
+    }
+  }
+
+  // the event thread runs until every transfer came back
+  read_thread.join();
+  for (auto transfer : read_transfers) {
+    libusb_free_transfer(transfer);
+  }
+  read_transfers.clear();
+}
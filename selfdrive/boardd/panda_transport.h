@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libusb-1.0/libusb.h>
+
+#define TIMEOUT 0
+
+// Moves requests and bulk data between boardd and a panda. The control requests and
+// endpoints are the ones of the panda USB interface, whatever the transport is.
+class PandaTransport {
+ public:
+  virtual ~PandaTransport(){};
+
+  std::string hw_serial;
+  std::atomic<bool> connected = true;
+  std::atomic<bool> comms_healthy = true;
+
+  virtual int control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout=TIMEOUT) = 0;
+  virtual int control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout=TIMEOUT) = 0;
+  virtual int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) = 0;
+  virtual int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT) = 0;
+
+  // Keeps num_transfers reads of length from endpoint in flight. on_data gets the data of
+  // each one on the transport's thread, and isn't called anymore once bulk_read_stop returns.
+  typedef std::function<void(const unsigned char *data, int length)> DataCallback;
+  virtual bool bulk_read_start(unsigned char endpoint, int length, int num_transfers, DataCallback on_data) = 0;
+  virtual void bulk_read_stop() = 0;
+};
+
+class UsbTransport : public PandaTransport {
+  libusb_context *ctx = NULL;
+  libusb_device_handle *dev_handle = NULL;
+  std::mutex usb_lock;
+  void handle_usb_issue(int err, const char func[]);
+  void cleanup();
+
+  // Asynchronous reads, the transfers are resubmitted by read_callback on read_thread
+  std::thread read_thread;
+  std::vector<libusb_transfer *> read_transfers;
+  std::mutex read_lock;
+  DataCallback on_data;
+  int read_in_flight = 0;
+  bool read_running = false;
+  static void LIBUSB_CALL read_callback(libusb_transfer *transfer);
+  void read_event_loop();
+
+ public:
+  UsbTransport(std::string serial="");
+  ~UsbTransport();
+
+  static std::vector<std::string> list();
+
+  int control_write(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned int timeout=TIMEOUT);
+  int control_read(uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout=TIMEOUT);
+  int bulk_write(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  int bulk_read(unsigned char endpoint, unsigned char* data, int length, unsigned int timeout=TIMEOUT);
+  bool bulk_read_start(unsigned char endpoint, int length, int num_transfers, DataCallback on_data);
+  void bulk_read_stop();
+};
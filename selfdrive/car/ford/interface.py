@@ -42,11 +42,11 @@ class CarInterface(CarInterfaceBase):
   # returns a car.CarState
   def update(self, c, can_strings):
     # ******************* do can recv *******************
-    self.cp.update_strings(can_strings)
+    self.can_parsers.update_strings(can_strings)
 
     ret = self.CS.update(self.cp)
 
-    ret.canValid = self.cp.can_valid
+    ret.canValid = self.can_parsers.can_valid
 
     # events
     events = self.create_common_events(ret)
@@ -10,6 +10,7 @@ from selfdrive.config import Conversions as CV
 from selfdrive.controls.lib.drive_helpers import V_CRUISE_MAX
 from selfdrive.controls.lib.events import Events
 from selfdrive.controls.lib.vehicle_model import VehicleModel
+from opendbc.can.parser import CANParserGroup
 
 GearShifter = car.CarState.GearShifter
 EventName = car.CarEvent.EventName
@@ -34,16 +35,23 @@ class CarInterfaceBase():
     self.steering_unpressed = 0
     self.low_speed_alert = False
 
+    self.can_parsers = None
     if CarState is not None:
       self.CS = CarState(CP)
       self.cp = self.CS.get_can_parser(CP)
       self.cp_cam = self.CS.get_cam_can_parser(CP)
       self.cp_body = self.CS.get_body_can_parser(CP)
+      # All the buses are parsed in one pass over each can packet
+      self.can_parsers = CANParserGroup(self.get_can_parsers(CP))
 
     self.CC = None
     if CarController is not None:
       self.CC = CarController(self.cp.dbc_name, CP, self.VM)
 
+  def get_can_parsers(self, CP):
+    # Parsers in the group updated by update(), brands with more parsers add theirs here
+    return [cp for cp in (self.cp, self.cp_cam, self.cp_body) if cp is not None]
+
   @staticmethod
   def get_pid_accel_limits(CP, current_speed, cruise_speed):
     return ACCEL_MIN, ACCEL_MAX
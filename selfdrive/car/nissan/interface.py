@@ -5,9 +5,9 @@ from selfdrive.car import STD_CARGO_KG, scale_rot_inertia, scale_tire_stiffness,
 from selfdrive.car.interfaces import CarInterfaceBase
 
 class CarInterface(CarInterfaceBase):
-  def __init__(self, CP, CarController, CarState):
-    super().__init__(CP, CarController, CarState)
+  def get_can_parsers(self, CP):
     self.cp_adas = self.CS.get_adas_can_parser(CP)
+    return super().get_can_parsers(CP) + [self.cp_adas]
 
   @staticmethod
   def get_params(candidate, fingerprint=gen_empty_fingerprint(), car_fw=None):
@@ -54,13 +54,11 @@ class CarInterface(CarInterfaceBase):
 
   # returns a car.CarState
   def update(self, c, can_strings):
-    self.cp.update_strings(can_strings)
-    self.cp_cam.update_strings(can_strings)
-    self.cp_adas.update_strings(can_strings)
+    self.can_parsers.update_strings(can_strings)
 
     ret = self.CS.update(self.cp, self.cp_adas, self.cp_cam)
 
-    ret.canValid = self.cp.can_valid and self.cp_adas.can_valid and self.cp_cam.can_valid
+    ret.canValid = self.can_parsers.can_valid
 
     buttonEvents = []
     be = car.CarState.ButtonEvent.new_message()
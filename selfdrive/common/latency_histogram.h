@@ -0,0 +1,45 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include "cereal/gen/cpp/log.capnp.h"
+
+// Latencies in the log2 buckets of cereal's LatencyHistogram, bucket i counts the ones of
+// [2^i, 2^(i+1)) us. Keep in sync with common/latency_histogram.py.
+class LatencyHistogram {
+public:
+  static const int BUCKETS = 20;
+
+  void add(uint64_t latency_ns) {
+    const uint64_t us = latency_ns / 1000;
+    const int bucket = (us > 0) ? std::min(63 - __builtin_clzll(us), BUCKETS - 1) : 0;
+    buckets[bucket]++;
+    count++;
+    sum_us += us;
+    max_us = std::max(max_us, us);
+  }
+
+  // Adds the latency from t to now, both nanos_since_boot
+  void add(uint64_t t, uint64_t now) {
+    add(now > t ? now - t : 0);
+  }
+
+  void write(cereal::LatencyHistogram::Builder h) const {
+    h.setCount(count);
+    h.setSumUs(sum_us);
+    h.setMaxUs(max_us);
+    auto b = h.initBuckets(BUCKETS);
+    for (int i = 0; i < BUCKETS; i++) b.set(i, buckets[i]);
+  }
+
+  void reset() {
+    *this = LatencyHistogram();
+  }
+
+  uint32_t count = 0;
+  uint64_t sum_us = 0;
+  uint64_t max_us = 0;
+  std::array<uint32_t, BUCKETS> buckets = {};
+};
@@ -5,6 +5,7 @@ from numbers import Number
 
 from cereal import car, log
 from common.numpy_fast import clip
+from common.latency_histogram import LatencyHistogram
 from common.realtime import sec_since_boot, config_realtime_process, Priority, Ratekeeper, DT_CTRL
 from common.profiler import Profiler
 from common.params import Params, put_nonblocking
@@ -175,6 +176,7 @@ class Controls:
     # controlsd is driven by can recv, expected at 100Hz
     self.rk = Ratekeeper(100, print_delay_threshold=None)
     self.prof = Profiler(False)  # off by default
+    self.can_latency = LatencyHistogram()
 
   def update_events(self, CS):
     """Compute carEvents from carState"""
@@ -342,6 +344,10 @@ class Controls:
     # Update carState from CAN
     can_strs = messaging.drain_sock_raw(self.can_sock, wait_for_one=True)
     CS = self.CI.update(self.CC, can_strs)
+    # The parser already read the logMonoTime of each can packet
+    if self.CI.can_parsers is not None:
+      for log_mono_time in self.CI.can_parsers.log_mono_times:
+        self.can_latency.add_since(log_mono_time)
 
     self.sm.update(0)
 
@@ -632,6 +638,9 @@ class Controls:
     controlsState.startMonoTime = int(start_time * 1e9)
     controlsState.forceDecel = bool(force_decel)
     controlsState.canErrorCounter = self.can_error_counter
+    if self.sm.frame % int(1. / DT_CTRL) == 0:
+      self.can_latency.write(controlsState.init('canLatency'))
+      self.can_latency.reset()
 
     if self.joystick_mode:
       controlsState.lateralControlState.debugState = lac_log
@@ -0,0 +1,34 @@
+#!/usr/bin/env python3
+# type: ignore
+
+# Latency of the can frames of boardd running on the simulated panda (SIM_PANDA=1),
+# the synthesized frames carry their generation time as 8 bytes of data
+
+import struct
+import numpy as np
+import cereal.messaging as messaging
+from common.realtime import sec_since_boot
+
+
+if __name__ == "__main__":
+  can_sock = messaging.sub_sock('can')
+
+  latencies = []
+  events = 0
+  prev_print = sec_since_boot()
+  while True:
+    for msg in messaging.drain_sock(can_sock, wait_for_one=True):
+      t = sec_since_boot()
+      events += 1
+      for c in msg.can:
+        if len(c.dat) == 8:
+          latencies.append(t - struct.unpack('<Q', c.dat)[0] / 1e9)
+
+    t = sec_since_boot()
+    if t - prev_print > 1 and len(latencies):
+      lat = np.array(latencies) * 1000
+      print("%d events, %d frames/s, latency median %.2fms p99 %.2fms max %.2fms" %
+            (events / (t - prev_print), len(lat) / (t - prev_print), np.median(lat), np.percentile(lat, 99), np.max(lat)))
+      latencies = []
+      events = 0
+      prev_print = t
@@ -2,6 +2,7 @@
 #include <sys/resource.h>
 
 #include <cmath>
+#include <map>
 
 #include "locationd.h"
 
@@ -443,37 +444,53 @@ int Localizer::locationd_thread() {
   const std::initializer_list<const char *> service_list =
       { "gpsLocationExternal", "sensorEvents", "cameraOdometry", "liveCalibration", "carState" };
   PubMaster pm({ "liveLocationKalman" });
-  SubMaster sm(service_list, nullptr, { "gpsLocationExternal" });
+  // Handle every observation in time order so the filter doesn't have to rewind,
+  // holding messages back for two sensorEvents periods. cameraOdometry doesn't wait
+  MessageMerger merger(service_list, 20 * 1000000ULL, nullptr, { "gpsLocationExternal" });
 
   Params params;
+  uint64_t camera_odometry_count = 0;
+  std::map<std::string, std::pair<uint64_t, uint64_t>> lost;
 
   while (!do_exit) {
-    sm.update();
-    for (const char* service : service_list) {
-      if (sm.updated(service) && sm.valid(service)) {
-        const cereal::Event::Reader log = sm[service];
+    merger.update();
+
+    // Publishing liveLocationKalman can't wait out the reorder window, so everything up to the
+    // newest cameraOdometry is handled now. The filter rewinds for anything older that arrives late
+    uint64_t flush_until = merger.newest("cameraOdometry");
+    cereal::Event::Reader log;
+    while (merger.next(log, flush_until)) {
+      if (log.getValid()) {
         this->handle_msg(log);
       }
-    }
 
-    if (sm.updated("cameraOdometry")) {
-      uint64_t logMonoTime = sm["cameraOdometry"].getLogMonoTime();
-      bool inputsOK = sm.allAliveAndValid();
-      bool sensorsOK = sm.alive("sensorEvents") && sm.valid("sensorEvents");
-      bool gpsOK = this->isGpsOK();
+      if (log.which() == cereal::Event::CAMERA_ODOMETRY) {
+        bool inputsOK = merger.allAliveAndValid();
+        bool sensorsOK = merger.alive("sensorEvents") && merger.valid("sensorEvents");
+        bool gpsOK = this->isGpsOK();
+
+        MessageBuilder msg_builder;
+        kj::ArrayPtr<capnp::byte> bytes = this->get_message_bytes(msg_builder, log.getLogMonoTime(), inputsOK, sensorsOK, gpsOK);
+        pm.send("liveLocationKalman", bytes.begin(), bytes.size());
 
-      MessageBuilder msg_builder;
-      kj::ArrayPtr<capnp::byte> bytes = this->get_message_bytes(msg_builder, logMonoTime, inputsOK, sensorsOK, gpsOK);
-      pm.send("liveLocationKalman", bytes.begin(), bytes.size());
+        if (++camera_odometry_count % 1200 == 0 && gpsOK) {  // once a minute
+          VectorXd posGeo = this->get_position_geodetic();
+          std::string lastGPSPosJSON = util::string_format(
+            "{\"latitude\": %.15f, \"longitude\": %.15f, \"altitude\": %.15f}", posGeo(0), posGeo(1), posGeo(2));
 
-      if (sm.frame % 1200 == 0 && gpsOK) {  // once a minute
-        VectorXd posGeo = this->get_position_geodetic();
-        std::string lastGPSPosJSON = util::string_format(
-          "{\"latitude\": %.15f, \"longitude\": %.15f, \"altitude\": %.15f}", posGeo(0), posGeo(1), posGeo(2));
+          std::thread([&params] (const std::string gpsjson) {
+            params.put("LastGPSPosition", gpsjson);
+          }, lastGPSPosJSON).detach();
+        }
+      }
+    }
 
-        std::thread([&params] (const std::string gpsjson) {
-          params.put("LastGPSPosition", gpsjson);
-        }, lastGPSPosJSON).detach();
+    // Samples locationd fell too far behind on never reach the filter
+    for (const char *service : service_list) {
+      std::pair<uint64_t, uint64_t> counts = { merger.dropped(service), merger.overruns(service) };
+      if (counts != lost[service]) {
+        LOGW("%s: %llu messages dropped, %llu queue overruns", service, (unsigned long long)counts.first, (unsigned long long)counts.second);
+        lost[service] = counts;
       }
     }
   }